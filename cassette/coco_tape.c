@@ -26,306 +26,325 @@
  * Cassette recording and decodes it.
  *
  * WAV FILE INFORMATION
- * This program only supports decoding WAV files formatted as 16-bit 
- * 1-channel PCM at a frequency of 44100. 
+ * This program supports decoding WAV files formatted as 8-bit unsigned,
+ * 16, 24 or 32-bit signed, or 32-bit float PCM at any frequency from
+ * 9600 up, see OTHER SAMPLE RATES in cocotape.c.
+ * Files with more than one channel are decoded from a single selected 
+ * channel. Everything is converted to 16-bit samples as it is read.
  *
- * ENCODING INFORMATION 
- * The cassette format chosen uses a sinewave of 2400 or 1200 Hertz 
- * to yield a Baud rate of approximately 1500 Baud. In this format, 
- * a 0 (or logic low) is represented by one cycle of 1200 Hertz, and 
- * a 1 (or logic high) is represented by one cycle of 2400 Hertz. A 
- * typical program tape would consist of a leader of alternating 1's 
- * and O's, followed by one or more blocks of data. A block of data 
- * is composed of 0 to 255 bytes of data with a checksum, sync byte, 
- * and the block length. 
- * 
- * DETAILED TAPE FORMAT INFORMATION 
- * The standard TRS-80 Color Computer tape is composed of the following 
- * items: 
- *	1. A leader consisting of 128 bytes of Hex 55 
- *	2. A Namefile block 
- *	3. A blank section of tape approximately equal to 0.5 seconds 
- * 	   in length; this allows BASIC time to evaluate the Namefile. 
- *	4. A second leader of 128 bytes of Hex 55 
- *	5. One or more Data blocks 
- *	6. An End of File block 
- *
- * The block format for Data blocks, Namefile blocks, or an End of File 
- * block is as follows: 
- *	1. One leader byte — 
- * 		55H = Leader byte
- *	2. One sync byte — 
- *		3CH = Sync byte
- *	3. One block type byte — 
- *		00H = Namefile 
- *		01H = Data 
- *		FFH = End of File 
- *	4. One block length byte — 
- *		00H to FFH 
- *	5. Data — 0 to 255 bytes 
- *	6. One checksum byte — 
- *		the sum of all the data plus block type and block length 
- *	7. One leader byte — 
- * 		55H = Leader byte
+ * DECODING
+ * The decoding itself is done by libcocotape, cocotape.c, where the
+ * tape format and how it is decoded are described. This program reads
+ * the WAV, pushes its samples through a decoder and lets it list the
+ * programs to stdout. Build with
+ *	cc -O2 -pthread -o coco_tape coco_tape.c cocotape.c
  *
- * The End of File block is a standard block with a length of 0 and 
- * the block type equal to FFH. 
- *
- * The Namefile block is a standard block with a length of 15 bytes (0FH) 
- * and the block type equals 00H. The 15 bytes of data provide information 
- * to BASIC and are employed as described below: 
- *	1. Eight bytes for the program name 
- *	2. One file type byte — 
- *		00H = BASIC 
- *		01H = Data 
- *		02H = Machine Language 
- *	3. One ASCII flag byte — 
- *		00H = Binary 
- *		FFH = ASCII 
- *	4. One Gap flag byte — 
- *		01H = Continuous 
- *		FFH = Gaps 
- *	5. Two bytes for the start address of a machine language program 
- *	6. Two bytes for the load address of a machine language program 
- * 
- * BASIC DATA BLOCK FORMAT
- * A BASIC data block is a byte array with up to 255 bytes. The format has
- * been reverse engineered and it appears to be line oriented with 
- * a null termination. Lines contain some metadata and are encoded with
- * CoCo BASIC tokens. The null termination may not be the correct way to
- * define a line as the meta data does seem to point at the beginning 
- * of the next line. However there are unexplained issue preventing its use
- * see below. 
+ * SWEEPING
+ * When neither the defaults nor -a get a tape through, -s tries a grid
+ * of ranges instead: -o from SWEEP_OL_MIN to SWEEP_OL_MAX and a 1/0
+ * boundary (-O, with -z one above it) from SWEEP_SPLIT_MIN to 
+ * SWEEP_SPLIT_MAX, plus the ranges given and -a. Pass one is only run
+ * once, every setting gets its own pass two over the same periods, 
+ * spread across -j threads. The decodes are silent and recover from a
+ * bad checksum as -r does, the setting with the most good blocks wins
+ * (fewest bad ones breaking a tie) and the tape is decoded once more 
+ * with it for real, also as -r. Build with -pthread.
  *
- * LINE FORMAT
- *	Offset:		Type:	Value:
- *	0		byte	Next Line Data Block Number (NLDBN)
- * 	1		byte	Next Line Offset in NLDBN (NLO)
- *	2:3		word	BASIC Program line number
- *	4-[NLDBN:NLO]	byte[]	Encoded BASIC Program line
+ * RECOVERY
+ * Normally the first block failing its checksum ends the decode. With
+ * -r it is marked bad and reported, and the decoder goes straight back
+ * to looking for a sync byte; a dropout may well have shifted the bits,
+ * so it does not wait out a leader byte first. A program with a bad 
+ * block is not listed, the blocks that failed are, and decoding carries
+ * on with the next one, see RECOVERY in cocotape.c. The exit status is
+ * still 1 if any block failed.
  *
- * Block numbers seem to start at 30 (0x1e). The NLDBN can point to the next
- * data block allowing lines to span data blocks. NLO is always relative to
- * the beginning of NLDBN. 
- * 
- * NLDBN:NLO ISSUES
- * NLDBN:NLO seems to be inconsistent wrt to where the next line lies.
- * When NLDBN is the first data block NLO seems to point to +1 into the
- * next line. Then when NLDBN is the second data block NLO points to the
- * the actual next line. Then when NLDBN is the third data block
- * NLO points to -1 of the next line and so on.
+ * BATCH
+ * A directory for FILENAME, or -L with a list of files, decodes them
+ * all on a pool of -j threads. Each thread has its own jobs, opening a
+ * file or decoding a piece of one, and takes the newest of them first;
+ * one with none left steals the oldest job of another. Long files are
+ * cut into pieces, see SPLITTING, so a few long captures don't leave 
+ * threads idle at the end. Listings go to stdout in input order, each
+ * after a "File:" line as soon as it and the ones before it are done,
+ * or with -D to a NAME.txt per file.
  *
- * Current best guess is that this is due to the way the original
- * authors chose to map a contiguous memory buffer into the
- * the data block scheme presented above. One of the issues is that
- * the scheme places a 255 byte limitation on data blocks making
- * data blocks line on boundaries not aligned to 256 or 1 byte addressing.
- * further complicating things is the fact that some lines of encoded basic
- * can span data block.
+ * SPLITTING
+ * A single mapped WAV decoded on more than one thread, without -b, -d,
+ * -E, -i, -N, -P, -S, -s or -v, goes through the same pool, as a batch
+ * of one. A quick pre-scan, wav_cuts(), looks at every GAP_STRIDE'th
+ * sample for quiet gaps and for leaders, runs of short and long 
+ * periods alternating, and the recording is cut in the middle of them
+ * into pieces of about its length over -j, between SPLIT_MIN_SECS and
+ * SPLIT_MAX_SECS. A file with nowhere to cut it, or in a batch run on
+ * one thread, is decoded straight through instead. Every piece is decoded 
+ * silently by its own decoder and the blocks read are put back together
+ * in tape order and listed by one more. A program on both sides of a
+ * cut, e.g. at the gap after its Namefile block, is stitched back 
+ * together. A cut that turns out to be inside a block after all, say a
+ * run of 0x55 data bytes taken for a leader, leaves the decoder before
+ * it busy, and that piece is decoded again together with the next.
  *
- * Their strategy is still not completely understood. But suffice it to
- * say the NLO number needs an adjustment in the way of an additional byte
- * tacked on per data block basis. For example, datablock 34, or the
- * 4th data block, needs 4 bytes tacked on to make it accurate.
+ * CATALOG
+ * -C lists what is on the tape, a line per program with its name, file
+ * type, ASCII flag, ML start and load addresses and size, without 
+ * reading the Data blocks, see CATALOG in cocotape.c. Works with a 
+ * batch, not with -b, -P or -s.
  *
- * This code uses the next line information to parse the data. It is non-
- * trivial as lines that end near the end of the data block get advanced
- * advanced to the next data block, simply adding the modifier causes
- * offset to overflow providing inaccurate numbers. for example if the
- * NLO was 254 and the modifier was 4 the offset would overflow to 2.
- * IN addition the NLO points to the start of the new line but printing
- * the current line wants to print until NLO - 1. Again the boundary
- * conditions cause problems.
+ * TAPE INDEX
+ * -X writes NAME.idx next to NAME.wav, every block's sample range,
+ * type, length, checksum and program. With it -x n decodes just the 
+ * n'th program on the tape, from where the block before it ended to the
+ * end of its End of File block, without reading the rest of the WAV.
+ * -X works with a batch, neither works with -b, -C, -P, -s or stdin.
  *
- * DECODING INFORMATION
- * This program takes a simple approach to decoding the data in the WAV file.
- * Since bits are encoded as a sine wave with a freq of either a 1200Hz (0)
- * or 2400Hz (1) AND since the WAV file format samples at a fixed rate of
- * 44100Hz, the number of data data points per sine wave cycle can identify 
- * the frequency. That is an encoded 1 will have 44100/2400=18.375 data 
- * points per cycle and an encoded 0 will have 44100/1200=36.75 data 
- * points per cycle. To find a cycle this code looks for a falling zero
- * crossing in the WAV data then starts counting the data points until the 
- * next falling zero crossing. 
+ * WINDOWS
+ * -S and -E decode only the samples from -S up to -E, each a sample
+ * number, or seconds with an s after it, e.g. -S 90.5s. A mapped WAV 
+ * is not read outside of them, a stream is read up to -S and dropped.
+ * -N NAME lists only the program called NAME, see SELECTING in 
+ * cocotape.c, and stops reading the WAV at its End of File block.
+ * Neither works with a batch, -x or -X, nor -N with -b or -s, nor -S
+ * and -E with a file saved with -P.
+ * -l n-m lists only BASIC lines n to m of each program, -l n just line
+ * n, looked up rather than listed up to, see NEXT LINE ADDRESS in 
+ * cocotape.c. It works with anything that lists.
  *
- * However, the CoCos 6 bit A/D converter made the accurancy of a 1200/2400
- * fequency very suspect, plus the variability in recordings and noise, means 
- * that the WAV data is not that precise, so data counts can not be fixed 
- * numbers but rather ranges.
+ * INCREMENTAL LISTING
+ * -i lists each BASIC line as soon as the Data block finishing it is
+ * read, see INCREMENTAL LISTING in cocotape.c, rather than the whole
+ * program after its End of File block, e.g. to watch a tape as it is
+ * played into a pipe. A single WAV is then not split.
  *
- * During testing it was determined that a 1 (high) was defined by the range
- * of 18-31, and a 0 (low) was 31-inf. These may prove to be slightly different
- * on a per recording basis, so params are provided to define them at runtime.
+ * BENCHMARKING
+ * -d gets the decoder's instrumented variant, see DECODE VARIANTS in 
+ * cocotape.c, otherwise it runs the production one. -b n times n runs
+ * of pass two with each, output off, on the recording given.
  */
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
-#include <ctype.h>
+#include <strings.h>
+#include <limits.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cocotape.h"
+#include "cocotape_simd.h"
+
+/*
+ * To stderr, apart from the listings. Batch workers hit these loading
+ * files while other files' listings are going to stdout in order.
+ */
+#define PRINT_ERROR(a, args...) fprintf(stderr, "ERROR %s() %s Line %d: " \
+					a "\n", __FUNCTION__, __FILE__, \
+					__LINE__, ##args);
 
-#define PRINT_ERROR(a, args...) printf("ERROR %s() %s Line %d: " a "\n", \
-				       __FUNCTION__, __FILE__, __LINE__, ##args);
+/*
+ * Turns n frames of some other sample format into the 16-bit samples
+ * the decoder runs on. src points at the selected channel of the first
+ * frame, stride is the frame size in bytes.
+ */
+typedef void (*wav_conv_t)(const uint8_t *src, int16_t *dst, uint32_t n,
+			   uint32_t stride);
 
 /* Holds wav file data */
 typedef struct {
-	uint32_t samples;
-	int16_t *data;
+	uint32_t samples;	/* Frames, one decoded sample each */
+	int16_t *data;		/* 16-bit mono only, points into the mapping */
+	uint8_t	*raw;		/* Start of the data chunk in the mapping */
+	void	*map;		/* Whole file mapping */
+	size_t	maplen;
+	uint8_t	*pos;		/* Header parse position in the mapping */
+	FILE	*file;		/* Stream instead of mapping, data is NULL */
+	uint64_t remaining;	/* Stream bytes left in the data chunk */
+	uint8_t	*stage;		/* Stream frames waiting for conversion */
+
+	uint32_t sample_rate;
+	uint16_t channels;
+	uint16_t bits_per_sample;
+	uint16_t block_align;	/* Frame size in bytes */
+	uint16_t channel;	/* Channel decoded */
+	wav_conv_t conv;	/* NULL when already 16-bit mono */
 } sound_t;
 
-enum blocktype {
-	BT_NAME 	= 0x00,		/* Name block */
-	BT_DATA 	= 0x01,		/* Data block */
-	BT_EOF		= 0xFF,		/* End of file block */
+/* RIFF chunk header */
+struct wav_chunk {
+	char	 id[4];
+	uint32_t size;
 };
 
-/* Name blocks define what is in subsequent data blocks */
-enum filetype {
-	FT_BASIC	= 0x00,		/* CoCo encoded BASIC */
-	FT_DATA		= 0x01,		/* raw data?? */
-	FT_ML		= 0x02,		/* machine language code */
+/* Body of the "fmt " chunk, little endian as it sits in the file */
+struct wav_fmt {
+	uint16_t format_type;		// 1 = PCM
+	uint16_t num_channels;		// 1
+	uint32_t sample_rate;		// 44100
+	uint32_t bytes_per_second;	// sample_rate * num_chans * bits_per_sample / 8
+	uint16_t block_align;		// num_channels * bits_per_sample / 8
+	uint16_t bits_per_sample;	// 16
+
+	/* WAVE_FORMAT_EXTENSIBLE only */
+	uint16_t cb_size;		// 22
+	uint16_t valid_bits;
+	uint32_t channel_mask;
+	uint8_t	 sub_format[16];	// GUID, first 2 bytes are the format
 };
 
-/* Defines if data is binary or ascii, so far only seen binary */
-enum asciiflag {
-	AF_BINARY	= 0x00,
-	AF_ASCII	= 0xFF,
-};
+#define WAV_FMT_PCMLEN		16	/* fmt chunk without the extension */
+#define WAVE_FORMAT_PCM		0x0001
+#define WAVE_FORMAT_IEEE_FLOAT	0x0003
+#define WAVE_FORMAT_EXTENSIBLE	0xFFFE
 
-/* 
- * Not sure what gapflag is for - service manual only defines 
- * continuous and gaps but have only seen 0x00.
+/*
+ * Bytes of the data chunk the kernel is asked to page in ahead of the
+ * decode loop; pages more than this far behind are handed back.
+ */
+#define WAV_READAHEAD	(1 << 20)
+
+/* Samples handed to the decode loop at a time */
+#define WAV_CHUNK_SAMPLES	(1 << 16)
+
+/*
+ * Cycle periods, pass one's output and pass two's input, see 
+ * cocotape_periods(). Either mapped from a period file or kept by the
+ * decoder that found them.
  */
-enum gapflag {
-	GF_UNKNOWN	= 0x00,
-	GF_CONT		= 0x01,
-	GF_GAPS		= 0xFF,
+struct periods {
+	const uint16_t	*p;
+	uint32_t	n;
+	uint32_t	sample_rate;
+	void		*map;		/* Loaded from a period file */
+	size_t		maplen;
+};
+
+/* Period file, a header then n little endian uint16 periods */
+#define PERIOD_MAGIC	"CCTPER01"
+
+struct period_hdr {
+	char		ph_magic[8];
+	uint32_t	ph_sample_rate;
+	uint32_t	ph_pad;
+	uint64_t	ph_n;
 };
 
-#define SYNCBYTE	0x3C
-#define LEADERBYTE	0x55
-
-#define PROGNAMELEN 	8
-#define MLSTARTLEN 	2
-#define MLLOADLEN 	2
-#define NAMEBLOCKLEN    15
-
-/* State machine states for reading in data */ 
-enum block_state {
-	BS_NEED_LEADBYTE,
-	BS_NEED_SYNCBYTE,
-	BS_NEED_BLOCKTYPE,
-	BS_NEED_LENGTH,
-	BS_NEED_DATA,
-	BS_NEED_NAME,
-	BS_NEED_FILETYPE,
-	BS_NEED_ASCIIFLAG,
-	BS_NEED_GAPFLAG,
-	BS_NEED_STARTADDR,
-	BS_NEED_LOADADDR,
-	BS_NEED_CKSUM,
-	BS_DONE,
+/* Tape index, a header then n records, see TAPE INDEX below */
+#define INDEX_MAGIC	"CCTIDX01"
+
+struct index_hdr {
+	char		ih_magic[8];
+	uint32_t	ih_sample_rate;
+	uint32_t	ih_pad;
+	uint64_t	ih_samples;	/* Of the WAV it indexes */
+	uint64_t	ih_n;
 };
 
-struct block {
-	enum block_state b_state;	/* State machine value for decoding */
-	struct block	*b_next;	/* Block list ptr */
-
-	enum blocktype	b_type;
-	uint8_t		b_length;
-	uint8_t		b_cksum;
-	uint8_t		*b_data;
-
-	/* Data specific to b_type == FT_NAME */
-	char		b_progname[PROGNAMELEN+1];
-	enum filetype	b_filetype;
-	enum asciiflag	b_asciiflag;
-	enum gapflag	b_gapflag;
-	uint8_t		b_mlstart[MLSTARTLEN];
-	uint8_t		b_mlload[MLLOADLEN];
-
-	/* Decoding scratch data */
-	uint8_t 	b_byte;
-	uint8_t 	b_nbit;
-	uint8_t		b_data_i;
-	uint8_t		b_progname_i;
-	uint8_t		b_mlstart_i;
-	uint8_t		b_mlload_i;
+/* A block, as struct block has it */
+struct index_rec {
+	uint64_t	ir_start, ir_end;	/* Samples, [start, end) */
+	int32_t		ir_num;
+	int32_t		ir_prog;
+	uint8_t		ir_type;
+	uint8_t		ir_length;
+	uint8_t		ir_bad;
+	uint8_t		ir_pad[5];
 };
 
-/* 
- * For binary encoded CoCo BASIC Programs, 
- * might be called tokenized BASIC Format 
-*/
-char token[][15] = {
-	/* Operator tokens */
-	
-	/* 0x80 */ "FOR", "GO", "REM", "'",
-	/* 0x84 */ "ELSE", "IF", "DATA", "PRINT",
-	/* 0x88 */ "ON", "INPUT", "END", "NEXT",
-	/* 0x8b */ "DIM", "READ", "RUN", "RESTORE",
-	/* 0x90	*/ "RETURN", "STOP", "POKE", "CONT",
-	/* 0x94	*/ "LIST", "CLEAR","NEW", "CLOAD",
-	/* 0x98	*/ "CSAVE", "OPEN", "CLOSE", "LLIST",
-	/* 0x9b	*/ "SET", "RESET", "CLS", "MOTOR",
-	/* 0xa0	*/ "SOUND", "AUDIO", "EXEC", "SKIPF",
-	/* 0xa4	*/ "TAB(", "TO", "SUB", "THEN",
-	/* 0xa8	*/ "NOT", "STEP", "OFF", "+",
-	/* 0xab	*/ "-", "*", "/", "^",
-	/* 0xb0	*/ "AND", "OR", ">", "=",
-	/* 0xb4	*/ "<", "DEL", "EDIT", "TRON",
-	/* 0xb8	*/ "TROFF", "DEF", "LET", "LINE",
-	/* 0xbb	*/ "PCLS", "PSET", "PRESET", "SCREEN",
-	/* 0xc0	*/ "PCLEAR", "COLOR", "CIRCLE", "PAINT",
-	/* 0xc4	*/ "GET", "PUT", "DRAW", "PCOPY",
-	/* 0xc8	*/ "PMODE", "PLAY", "DLOAD", "RENUM",
-	/* 0xcb */ "FN", "USING",
-
-	/* RSDOS adds these .. (from Dragon User 12/84) */
-	/* 0xce	*/ "DIR", "DRIVE",
-	/* 0xd0	*/ "FIELD", "FILES", "KILL", "LOAD",
-	/* 0xd4 */ "LSET", "MERGE", "RENAME", "RSET",
-	/* 0xd8	*/ "SAVE", "WRITE", "VERIFY", "UNLOAD",
-	/* 0xdb */ "DSKINI", "BACKUP", "COPY", "DSKI$",
-	/* 0xe0	*/ "DSKO$",
+/* Either built up as a recording is decoded or mapped from its file */
+struct tape_index {
+	struct index_rec *r;
+	uint32_t	n, cap;
+	uint32_t	sample_rate;
+	uint64_t	samples;
+	bool		err;		/* A record could not be added */
+	void		*map;
+	size_t		maplen;
 };
 
-char ftoken[][15] = {
-	/* Function tokens - proceeded by 0xff to differentiate from operators */
-
-	/* 0x80 */ "SGN", "INT", "ABS", "USR",
-	/* 0x84 */ "RND", "SIN", "PEEK", "LEN", 
-	/* 0x88 */ "STR$", "VAL", "ASC", "CHR$",
-	/* 0x8b */ "EOF", "JOYSTK", "LEFT$", "RIGHT$", 
-	/* 0x90 */ "MID$", "POINT", "INKEY$", "MEM",
-	/* 0x94 */ "ATN", "COS", "TAN", "EXP", 
-	/* 0x98 */ "FIX", "LOG", "POS", "SQR",
-	/* 0x9b */ "HEX$", "VARPTR", "INSTR", "TIMER", 
-	/* 0xa0 */ "PPOINT", "STRING$",
-
-	/* RSDOS adds these .. (from Dragon User 12/84) */
-	/* 0xa2 */ "CVN", "FREE",
-	/* 0xa4 */ "LOC", "LOF", "MKN$",
+/* The -s grid, data points at 44100Hz, see SWEEPING above */
+#define SWEEP_OL_MIN	10
+#define SWEEP_OL_MAX	20
+#define SWEEP_OL_STEP	2
+#define SWEEP_SPLIT_MIN	22
+#define SWEEP_SPLIT_MAX	36
+
+/* One -s setting and how it did */
+struct sweep_cand {
+	int		o, O, z, Z;	/* As -o/-O/-z/-Z */
+	bool		cal;		/* As -a */
+	int32_t		good, bad;	/* Blocks passing/failing checksum */
 };
 
-#define ZL 31
-#define ZH 1000
-#define OL 18
-#define OH 31
+/* A -S/-E position, see WINDOWS above */
+struct wav_pos {
+	double		wp_v;
+	bool		wp_secs;	/* wp_v is seconds, not samples */
+	bool		wp_set;
+};
+
+/* Pieces a recording is cut into are this long, see SPLITTING above */
+#define SPLIT_MIN_SECS		5
+#define SPLIT_MAX_SECS		60
+
+/* Quiet gaps and leaders a recording can be cut at, see wav_cuts() */
+#define GAP_WIN_MS	10	/* Loudness measured per window */
+#define GAP_MIN_MS	250	/* Shortest gap, half the Namefile gap */
+#define GAP_STRIDE	4	/* Every 4th sample at 44100Hz, */
+#define GAP_STRIDE_RATE	44100	/* 2 or more per 2400Hz half cycle of 9 */
+#define GAP_RATIO	8	/* Quiet is under 1/8 of the loudest peak */
+#define LEADER_CYCLES	512	/* Half of a leader's 128 bytes of 0x55 */
+#define LEADER_RATIO_LO	14	/* Long/short of adjacent periods, tenths */
+#define LEADER_RATIO_HI	28
 
 char *progname;
-int d_debug = 0;
-int z_zero_low	= ZL;
-int Z_zero_high	= ZH;
-int o_one_low	= OL;
-int O_one_high	= OH;
 int v_verbose = 0;
+int c_channel = 0;
+int s_sweep = 0;
+int b_bench = 0;
+int j_threads = 0;
+int X_index = 0;
+int x_prog = 0;
+struct wav_pos S_start;
+struct wav_pos E_end;
 
 bool load_wav(const char *filename, sound_t *sound);
-int  process_bit(struct block *cb);
-int  print_prog(struct block *cb);
-void hexdump(const void* data, size_t size);
+void wav_readahead(sound_t *sound, uint32_t from, uint32_t sample);
+uint32_t wav_read(sound_t *sound, int16_t *buf, uint32_t n);
+const int16_t *wav_window(sound_t *sound, uint32_t sample, uint32_t n,
+			  int16_t *buf);
+void unload_wav(sound_t *sound);
+bool wav_pos_parse(const char *arg, struct wav_pos *wp);
+uint32_t wav_pos(const struct wav_pos *wp, const sound_t *wav,
+		 uint32_t dflt);
+int  decode_wav(sound_t *wav, struct cocotape *ctx, uint32_t start,
+		uint32_t end, int16_t *chunk);
+int  sweep(const struct cocotape_config *cfg, const struct periods *pa,
+	   int nthreads, struct sweep_cand *best);
+void bench(const struct cocotape_config *cfg, const struct periods *pa,
+	   int runs);
+bool periods_probe(const char *filename);
+bool periods_load(const char *filename, struct periods *pa);
+bool periods_save(const char *filename, const struct periods *pa);
+void periods_free(struct periods *pa);
+uint32_t wav_cuts(sound_t *wav, uint32_t every, uint32_t *cut,
+		  uint32_t maxcut, int16_t *chunk);
+int  batch(const struct cocotape_config *cfg, char **names, uint32_t nfiles,
+	   const char *outdir, bool titled, bool index, int nthreads);
+int  batch_names(const char *dir, const char *list, char ***names);
+void index_init(struct tape_index *ti, const sound_t *wav);
+void index_block(void *arg, const struct block *b);
+bool index_save(const char *wavname, struct tape_index *ti);
+bool index_load(const char *wavname, struct tape_index *ti);
+void index_free(struct tape_index *ti);
+int  index_decode(const struct cocotape_config *cfg, const char *filename,
+		  int32_t prog);
 
 
 void
@@ -335,16 +354,39 @@ usage()
 
 	char msg[] = "\n\
 Where, OPTIONS are [default]:\n\
+	-a           Calibrate the 1/0 ranges from each leader, overrides -o/-O/-z\n\
+	-b n         Benchmark n runs of each decode variant first\n\
+	-c           Channel to decode in a multi-channel file [0]\n\
+	-C           Catalog, only list the programs on the tape\n\
 	-d           Turn on debugging output\n\
+	-D dir       Batch listings to dir/NAME.txt, not stdout in input order\n\
+	-E n         Decode up to sample n, or n seconds as ns [end]\n\
+	-i           List each line as soon as its Data block is read\n\
+	-j n         Threads for -s, batches and pieces [number of cpus]\n\
+	-l n[-m]     List only BASIC lines n to m, or line n [all]\n\
+	-L file      Batch decode the WAV files listed in file, - for stdin\n\
+	-N name      List only the program name, stop reading after it\n\
 	-z           Low num of data points that correspond to a zero [32]\n\
 	-Z           High num of data points that correspond to a zero [inf]\n\
 	-o           Low num of data points that correspond to a one [18]\n\
 	-O           High num of data points that correspond to a one [31]\n\
+	             (data points are at 44100Hz, scaled to the file's rate)\n\
+	-P file      Save the cycle periods found to file\n\
+	-r           Recover from bad checksums, carry on with the next block\n\
+	-s           Sweep the 1/0 ranges, decode with the best found\n\
+	-S n         Decode from sample n, or n seconds as ns [0]\n\
 	-v           Turn on verbose output\n\
+	-x n         Decode only program n, using the tape index\n\
+	-X           Write a tape index, NAME.idx, next to the WAV\n\
 	-?           Help\n\
 \n\
-Where, FILENAME is a 16-bit 1-channel PCM .WAV encoded file containing\n\
-a Color Computer Cassette audio recording.\n\
+Where, FILENAME is an 8, 16, 24 or 32-bit integer or 32-bit float PCM\n\
+.WAV encoded file containing a Color Computer Cassette audio recording,\n\
+any number of channels. A FILENAME of - reads the\n\
+recording from stdin, e.g. a pipe, in constant memory. FILENAME may also\n\
+be a file saved with -P, which decodes without going back to the WAV,\n\
+e.g. to try different -o/-O/-z/-Z values or -s on a bad tape.\n\
+A FILENAME that is a directory batch decodes every .wav file in it.\n\
 ";
 
 	fprintf(stderr, "%s", msg);
@@ -359,19 +401,112 @@ main(int argc, char *argv[])
 
 	extern char     *optarg;
         extern int	optind, opterr, optopt;
-        char		c, *cp, *filename=NULL;
-	int32_t		count = 0, nblocks=0;
+        char		c, *cp, *filename=NULL, *pfilename=NULL;
+	char		*lfilename=NULL, *outdir=NULL, **names;
+	int32_t		count = 0, lines;
+	struct stat	st;
 	sound_t 	wav;
-	struct block 	*blocks = NULL;		/* Root block list ptr */
-	struct block 	*cb = NULL;		/* Current block ptr */
-	struct block 	*pb = NULL;		/* Previous block ptr */
+	struct cocotape_config cfg;
+	struct cocotape	*ctx = NULL, *scan = NULL;
+	struct periods	pa;
+	struct tape_index ti;
+	bool		deferred = false;	/* Pass two still to run */
+	bool		isdir, window;
+	uint32_t	start, end;
+	int		rc;
+	static int16_t	chunk[WAV_CHUNK_SAMPLES];
 
 	progname = argv[0];
+	cocotape_defaults(&cfg, 0);
 	
-        while ((c = getopt(argc, argv, "doOzZvh?")) != (char)EOF) {
+        while ((c = getopt(argc, argv, "ab:c:CdD:E:ij:l:L:N:o:O:P:rsS:x:Xz:Z:vh?")) != (char)EOF) {
                 switch (c) {
+		case 'a':
+			cfg.autocal = true;
+			break;
+
+		case 'b':
+			b_bench = strtol(optarg, &cp, 0);
+			if (!cp || *cp != '\0' || b_bench < 1) {
+				fprintf(stderr, "**** Invalid Runs %s\n",
+				       optarg);
+				usage();
+				return(-1);
+			}
+			break;
+
+		case 'c':
+			c_channel = strtol(optarg, &cp, 0);
+			if (!cp || *cp != '\0' || c_channel < 0) {
+				fprintf(stderr, "**** Invalid Channel %s\n",
+				       optarg);
+				usage();
+				return(-1);
+			}
+			break;
+
 		case 'd':
-			d_debug = 1;
+			cfg.debug = true;
+			break;
+
+		case 'C':
+			cfg.catalog = true;
+			break;
+
+		case 'D':
+			outdir = optarg;
+			break;
+
+		case 'E':
+		case 'S':
+			if (!wav_pos_parse(optarg,
+					   (c == 'S') ? &S_start : &E_end)) {
+				fprintf(stderr, "**** Invalid Position %s\n",
+				       optarg);
+				usage();
+				return(-1);
+			}
+			break;
+
+		case 'i':
+			cfg.incremental = true;
+			break;
+
+		case 'j':
+			j_threads = strtol(optarg, &cp, 0);
+			if (!cp || *cp != '\0' || j_threads < 1) {
+				fprintf(stderr, "**** Invalid Threads %s\n",
+				       optarg);
+				usage();
+				return(-1);
+			}
+			break;
+
+		case 'l':
+			lines = strtol(optarg, &cp, 10);
+			if (*cp == '-')
+				count = strtol(cp + 1, &cp, 10);
+			else
+				count = lines;
+			/* A last line of 0 would be to the end */
+			if ((cp == optarg) || *cp || (lines < 0) || (count < 1) ||
+			    (count < lines) || (count > UINT16_MAX)) {
+				fprintf(stderr, "**** Invalid Lines %s\n",
+				       optarg);
+				usage();
+				return(-1);
+			}
+			cfg.first_line = lines;
+			cfg.last_line = count;
+			count = 0;
+			break;
+
+		case 'L':
+			lfilename = optarg;
+			break;
+
+		case 'N':
+			cfg.program = optarg;
 			break;
 
 		case 'o':
@@ -399,15 +534,42 @@ main(int argc, char *argv[])
 				return(-1);
 			}
 
-			if (c == 'o') o_one_low   = count;
-			if (c == 'O') O_one_high  = count;
-			if (c == 'z') z_zero_low  = count;
-			if (c == 'Z') Z_zero_high = count;
+			if (c == 'o') cfg.one_low   = count;
+			if (c == 'O') cfg.one_high  = count;
+			if (c == 'z') cfg.zero_low  = count;
+			if (c == 'Z') cfg.zero_high = count;
 			count = 0;
 			break;
 			
+		case 'P':
+			pfilename = optarg;
+			break;
+
+		case 'r':
+			cfg.recover = true;
+			break;
+
+		case 's':
+			s_sweep = 1;
+			break;
+
+		case 'x':
+			x_prog = strtol(optarg, &cp, 0);
+			if (!cp || *cp != '\0' || x_prog < 1) {
+				fprintf(stderr, "**** Invalid program %s\n",
+				       optarg);
+				usage();
+				return(-1);
+			}
+			break;
+
+		case 'X':
+			X_index = 1;
+			break;
+
 		case 'v':
 			v_verbose = 1;
+			cfg.verbose = true;
 			break;
 
 		case 'h':
@@ -419,7 +581,9 @@ main(int argc, char *argv[])
         }
 
 	// Check for the key and value parms
-	if (argc - optind == 1) {
+	if (lfilename && argc - optind == 0) {
+		/* Batch of the listed files */
+	} else if (argc - optind == 1) {
 		filename = argv[optind];
 	} else if (argc - optind < 1) {
 		fprintf(stderr, "**** Missing FILENAME\n");
@@ -429,724 +593,2196 @@ main(int argc, char *argv[])
 		usage();
 	}
 
-	if(!load_wav(filename, &wav)) {
-		PRINT_ERROR("Failed to load .wav");
-		return -1;
+	if (cfg.catalog && (b_bench || s_sweep || pfilename)) {
+		fprintf(stderr, "**** -C can't be used with -b, -P or -s\n");
+		usage();
 	}
 
-	if (v_verbose) printf ("Samples:  %d\n", wav.samples);
-	
-	for(int j = 1; j < wav.samples; j++) {
-		//		printf("WAV: %d\n",wav.data[j]); 
-		if (!cb) {
-			/* need to allocate a block */
-			cb = (struct block *)malloc(sizeof(struct block));
-			if (!cb) {
-				PRINT_ERROR("Failed to malloc CB");
-				return -1;
-			}
+	if ((X_index || x_prog) &&
+	    (b_bench || s_sweep || pfilename || cfg.catalog ||
+	     (filename && (!strcmp(filename, "-") ||
+			   periods_probe(filename))))) {
+		fprintf(stderr, "**** -x and -X need a WAV and can't be used "
+			"with -b, -C, -P or -s\n");
+		usage();
+	}
 
-			memset(cb, 0, sizeof(struct block));
-			cb->b_state = BS_NEED_SYNCBYTE;
+	window = S_start.wp_set || E_end.wp_set;
+	if ((window || cfg.program) && (X_index || x_prog)) {
+		fprintf(stderr, "**** -E, -N and -S can't be used with -x "
+			"or -X\n");
+		usage();
+	}
+	if (cfg.program && (b_bench || s_sweep)) {
+		fprintf(stderr, "**** -N can't be used with -b or -s\n");
+		usage();
+	}
+	if (window && filename && periods_probe(filename)) {
+		fprintf(stderr, "**** -E and -S need a WAV\n");
+		usage();
+	}
 
-			if (!blocks) blocks = cb;
-			if (pb) pb->b_next = cb;
-			pb = cb;
-			nblocks++;
+	/* One per cpu unless -j says otherwise */
+	if (!j_threads)
+		j_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (j_threads < 1)
+		j_threads = 1;
+
+	isdir = filename && !stat(filename, &st) && S_ISDIR(st.st_mode);
+	if (lfilename || outdir || isdir) {
+		/* A batch, see BATCH above */
+		if (cfg.debug || v_verbose || b_bench || s_sweep || pfilename ||
+		    x_prog || window || cfg.program) {
+			fprintf(stderr, "**** -b, -d, -E, -N, -P, -S, -s, -v "
+				"and -x need a single FILENAME\n");
+			usage();
 		}
-
-		/* Use falling zero crossings to determine a cycle */
-		if ((wav.data[j] < 0) &&
-		    (wav.data[j-1] >= 0)) {
-			/* Falling zero crossing */ 
-			if (d_debug && cb->b_state == BS_NEED_LENGTH)
-				printf("count: %d\n", count);
-
-			if ((count >= o_one_low) &&
-			    (count <= O_one_high)) {
-				/* Found a 1 */
-				cb->b_byte = (cb->b_byte >> 1) | 0x80;
-			} else if ((count >= z_zero_low) &&
-				 (count <= Z_zero_high)) {
-				/* Found a 0 */
-				cb->b_byte = (cb->b_byte >> 1);
-			} else {
-				if (d_debug) {
-					printf("Not 1200/2400Hz waveform: %d\n",
-					       count);
-					for(int k=j-50; k<j+50; k++)
-						if (cb->b_state == BS_NEED_DATA)
-							printf("WAV: %d\n",
-							       wav.data[k]);
-				}
-			}
-			//printf("Curr Byte: 0x%02x\n", cb->b_byte);
-			
-			if (process_bit(cb)) {
-				exit(1);
-			}
-			if (cb->b_state == BS_DONE) { 
-				if (cb->b_type == BT_EOF) {
-					/* Completed a prog */
-					print_prog(blocks);
-
-					/* Free up the blocks */
-					pb = blocks;
-					while (pb) {
-						cb = pb->b_next;
-						free(pb->b_data);
-						free(pb);
-						pb = cb;
-					}
-					blocks = pb = NULL;
-				}
-				/* Time to start another block */
-				cb = NULL;
-			}
-
-			/* reset the data point count, to start next cycle */
-			count = 0;
+		if (!lfilename && !isdir) {
+			fprintf(stderr, "**** -D needs a directory or -L\n");
+			usage();
 		}
-		count++;
+
+		if ((count = batch_names(lfilename ? NULL : filename,
+					 lfilename, &names)) < 0)
+			exit(1);
+		rc = batch(&cfg, names, count, outdir, true, X_index,
+			   j_threads);
+		while (count--)
+			free(names[count]);
+		free(names);
+		exit(rc ? 1 : 0);
 	}
 
-	print_prog(blocks);
+	if (x_prog) {
+		/* Straight to the program, see TAPE INDEX above */
+		exit(index_decode(&cfg, filename, x_prog) ? 1 : 0);
+	}
 
-	if (v_verbose) {
-		printf("Decoded %d blocks\n", nblocks);
-		for (cb=blocks; cb->b_next; cb=cb->b_next) {
-			switch (cb->b_type) {
-			case BT_NAME:
-				printf("Name Block\n");
-				break;
-			case BT_DATA:
-				printf("DATA Block (%d)\n", cb->b_length);
-				break;
-			case BT_EOF:
-				printf("EOF Block\n");
-				break;
-			default:
-				printf("Bad block type %d\n", cb->b_type);
-				break;
-			}
-		}
+	if (!cfg.debug && !v_verbose && !b_bench && !s_sweep && !pfilename &&
+	    !window && !cfg.program && !cfg.incremental && (j_threads != 1) &&
+	    strcmp(filename, "-") &&
+	    !periods_probe(filename)) {
+		/* A batch of one, decoded in pieces, see SPLITTING above */
+		exit(batch(&cfg, &filename, 1, NULL, false, X_index,
+			   j_threads) ? 1 : 0);
 	}
 
-	exit(0);
-}
+	/* The sweep scores settings recovering, so decode the same way */
+	if (s_sweep)
+		cfg.recover = true;
 
-/*
-* print a buffer as an ascii string but where chars are unprintable replace
-* then with a "\HH" notation where H is an ascii hexdigit.
-* ex "O\x01--\x7F\xFF"
-*/
-void
-asciidump(const void* data, size_t size)
-{
-	size_t i;
-	
-	for (i = 0; i < size; ++i) {
-		if (isprint((int)(((unsigned char*)data)[i]))) {
-			printf("%c", ((unsigned char*)data)[i]);
-		} else {
-			if ((((unsigned char *)data)[i] > 0x7f) &&
-			    (((unsigned char *)data)[i] < 0xe0)) {
-				printf("%s", token[((unsigned char *)data)[i]-0x80]);
-			} else if (((unsigned char *)data)[i] == 0xff) {
-				i++;
-				printf("%s", ftoken[((unsigned char *)data)[i]-0x80]);				} else {
-				if (((unsigned char*)data)[i])
-					printf("\\x%02X", ((unsigned char*)data)[i]);
-			}
-		}
-	}
-}
+	memset(&pa, 0, sizeof(pa));
 
-int
-print_prog(struct block *cb)
-{
-#define LINELEN 4096
-	
-	int i, j, llen  ;
-	uint16_t lineno;
-	uint8_t eol, blkn, line[LINELEN];
-	struct nl {
-#define BLKNBASE 0x1e
-		uint8_t blkn, off;
-	} nl;
-
-	if (cb && (cb->b_state == BS_DONE) && (cb->b_type == BT_NAME)) {
-		printf("Program: %8s\n", cb->b_progname);
-	}
-		       
-	while (cb && (cb->b_type != BT_DATA))
-		cb =cb->b_next;
-
-	if (!cb) return(0);
-	
-	blkn = BLKNBASE;
-	if (d_debug) printf("Block %d\n", blkn);
+	if (periods_probe(filename)) {
+		/* Pass one was done on an earlier run */
+		if (!periods_load(filename, &pa)) {
+			PRINT_ERROR("Failed to load periods");
+			return -1;
+		}
 
-	/*
-	 * This code uses the data provided new line information to
-	 * delimit a line.  THis is non-trial code. PLease read
-	 * NLDBN:NLO ISSUES above to better understand this code.
-	 */
-	i=0;
-	while(cb) {
-		/* Three trailing nulls seem to terminate the data */
-		/* Careful - this might span data blocks - checked not handled */
-		if (((cb->b_length - i) == 2) &&
-		    (cb->b_data[i]   == 0) &&
-		    (cb->b_data[i+1] == 0) &&
-		    (cb->b_data[i+2] == 0)) {
-			/* We're done here */
-			return(0);
+		if (v_verbose) printf ("Cycles:   %u\n", pa.n);
+		deferred = true;
+	} else {
+		if(!load_wav(filename, &wav)) {
+			PRINT_ERROR("Failed to load .wav");
+			return -1;
 		}
 
-		/* set the new line block number */
-		nl.blkn = cb->b_data[i];
-		if ((nl.blkn != blkn) && (nl.blkn != blkn+1))  {
-			printf("bad start of line 0x%02x != 0x%02x 0x%02x\n",
-			       cb->b_data[i], blkn, i);
-			hexdump(cb->b_data, cb->b_length);
+		if (v_verbose) printf ("Samples:  %d\n", wav.samples);
+
+		/* See WINDOWS above, a stream of unknown length to its end */
+		end = (wav.map || wav.samples) ? wav.samples : UINT32_MAX;
+		start = wav_pos(&S_start, &wav, 0);
+		end = wav_pos(&E_end, &wav, end);
+		if (start >= end) {
+			fprintf(stderr, "**** Nothing between -S and -E\n");
 			exit(1);
 		}
 
-		/* next byte - remember it might span data blocks */
-		i++;
-		if (i == cb->b_length) {
-			/* time to jump */
-			i = 0;
-			cb = cb->b_next;
-			blkn++;
-		}
-		
 		/*
-		 * Set the new lines offset. Add in the modifier and
-		 * subtract 1 because the data assume indexes start at 1.
-		 * care needs to be taken as adding the modifier can 
-		 * cross an actuall blk boundary necessatating the
-		 * modificationg of the provided block number.
+		 * The periods are only kept if they are wanted afterwards,
+		 * by -b, -s or -P, mapped or not; a stream's would grow
+		 * without bound. A sweep or a benchmark wants them all 
+		 * before pass two starts.
 		 */
-		if ((nl.blkn - BLKNBASE) > (255-cb->b_data[i])) {
-			nl.blkn++;
+		cfg.sample_rate = wav.sample_rate;
+		if (X_index) {
+			index_init(&ti, &wav);
+			cfg.on_block = index_block;
+			cfg.arg = &ti;
 		}
-		nl.off = cb->b_data[i] + (nl.blkn - BLKNBASE) - 1;
-		
-		/* next byte - remember it might span data blocks */
-		i++;
-		if (i == cb->b_length) {
-			/* time to jump */
-			i = 0;
-			cb = cb->b_next;
-			blkn++;
+		if (s_sweep || b_bench) {
+			/* Silent and never stopping, only after periods */
+			struct cocotape_config scfg = cfg;
+
+			scfg.out = NULL;
+			scfg.recover = true;
+			scfg.keep = true;
+			if (!(scan = cocotape_new(&scfg)) ||
+			    decode_wav(&wav, scan, start, end, chunk))
+				exit(1);
+			pa.p = cocotape_periods(scan, &pa.n);
+			deferred = true;
+		} else {
+			cfg.keep = b_bench || s_sweep || pfilename;
+			if (!(ctx = cocotape_new(&cfg)) ||
+			    decode_wav(&wav, ctx, start, end, chunk))
+				exit(1);
+			pa.p = cocotape_periods(ctx, &pa.n);
 		}
+		pa.sample_rate = wav.sample_rate;
 
-		/* Grab the most sigicant byte of the line number */
-		lineno = (uint16_t)cb->b_data[i] << 8;
+		unload_wav(&wav);
+	}
 
-		/* next byte - remember it might span data blocks */
-		i++;
-		if (i == cb->b_length) {
-			/* time to jump */
-			i = 0;
-			cb = cb->b_next;
-			blkn++;
-		}
+	if (b_bench)
+		bench(&cfg, &pa, b_bench);
 
-		/* Grab the least sigicant byte of the line number */
-		lineno = lineno | (uint16_t)cb->b_data[i];
+	if (s_sweep) {
+		struct sweep_cand	best;
 
-		/* next byte - remember it might span data blocks */
-		i++;
-		if (i == cb->b_length) {
-			/* time to jump */
-			i = 0;
-			cb = cb->b_next;
-			blkn++;
-		}
+		if (sweep(&cfg, &pa, j_threads, &best))
+			exit(1);
 
-		/* Copy the line - copy because it may span blocks */
-		j=0; llen=0;
-		while (1) {
-			line[j++] = cb->b_data[i];
-			llen++;
-
-			/* next byte - remember it might span data blocks */
-			i++;
-			if (i == cb->b_length) {
-				/* time to span */
-				i = 0;
-				cb = cb->b_next;
-				blkn++;
-			}
+		/* As if the winner had been given on the command line */
+		cfg.one_low   = best.o;
+		cfg.one_high  = best.O;
+		cfg.zero_low  = best.z;
+		cfg.zero_high = best.Z;
+		cfg.autocal   = best.cal;
+	}
 
-			if (j>=LINELEN) {
-				printf("Line too big for buffer (%d>=%d)\n",
-				       j, LINELEN);
-				exit(1);
-			}
+	if (deferred) {
+		cfg.sample_rate = pa.sample_rate;
+		cfg.keep = false;
+		if (!(ctx = cocotape_new(&cfg)) ||
+		    cocotape_push_periods(ctx, pa.p, pa.n))
+			exit(1);
+	}
 
-			/*
-			 * check to see if we have arrived at the last byte,
-			 * NLO - 1
-			 * two cases here the nominal case nl.off is nonzero
-			 * and the boundary case where nl.off is zero making
-			 * -1 not possible, so the code manual backs it up
-			 * to check.
-			 */
-			if (nl.off  && (blkn == nl.blkn) && (i == nl.off - 1))
-				break;
-			if (!nl.off && (blkn == nl.blkn-1) && (i == 254))
-				break;
-		}
+	rc = cocotape_finish(ctx);
 
-		/* next byte - remember it might span data blocks */
-		i++;
-		if (i == cb->b_length) {
-			/* time to jump */
-			i = 0;
-			cb = cb->b_next;
-			blkn++;
-		}
+	if (X_index) {
+		if (!index_save(filename, &ti))
+			rc = 1;
+		index_free(&ti);
+	}
 
-		printf("%5d ", lineno);
-		asciidump(line, llen);
-		memset(line, 0, LINELEN);
-		printf("\n");
+	if (pfilename && !periods_save(pfilename, &pa)) {
+		PRINT_ERROR("Failed to save periods");
+		return -1;
 	}
-		
-}
 
+	periods_free(&pa);
+	cocotape_free(scan);
+	cocotape_free(ctx);
+	exit(rc ? 1 : 0);
+}
 
+/*
+ * Decodes samples start up to end of a loaded WAV, handing ctx a chunk
+ * of samples at a time through chunk, WAV_CHUNK_SAMPLES long. A stream
+ * must be where it was loaded, it is read from there and whatever comes
+ * before start dropped. Stops early once ctx is done, see -N.
+ */
 int
-process_bit(struct block *cb)
+decode_wav(sound_t *wav, struct cocotape *ctx, uint32_t start, uint32_t end,
+	   int16_t *chunk)
 {
-	switch (cb->b_state) {
-	case BS_NEED_SYNCBYTE:
-		if (cb->b_byte == SYNCBYTE) {
-			/* Found header */
-			if (d_debug)
-				printf("Found header byte: 0x%02x\n",
-				       cb->b_byte);
-			cb->b_byte = 0;
-			cb->b_nbit = 1;
-			cb->b_state = BS_NEED_BLOCKTYPE;
-		}
-		break;
-		
-	case BS_NEED_BLOCKTYPE:
-		if (cb->b_nbit == 8) {
-			if (d_debug)
-				printf("Found BLOCK TYPE: 0x%02x\n", cb->b_byte);
-			if ((cb->b_byte == BT_NAME) ||
-			    (cb->b_byte == BT_DATA) ||
-			    (cb->b_byte == BT_EOF))  {
-				    cb->b_type = cb->b_byte;
-				    cb->b_cksum = cb->b_byte;
-				    cb->b_byte = 0;
-				    cb->b_nbit = 0;
-				    cb->b_state = BS_NEED_LENGTH;
-			    } else {
-				    cb->b_byte = 0;
-				    cb->b_nbit = 0;
-				    cb->b_state = BS_NEED_SYNCBYTE;
-				    if (d_debug)
-					    printf("Found bad block type, resetting\n");
-			    }
-				    
-		}
-		cb->b_nbit++;
-		break;
-		
-	case BS_NEED_LENGTH:
-		if (cb->b_nbit == 8) {
-			if (d_debug)
-				printf("Found LENGTH: 0x%02x\n", cb->b_byte);
-			cb->b_length = cb->b_byte;
-			cb->b_cksum += cb->b_byte;
-			cb->b_byte = 0;
-			cb->b_nbit = 0;
-			if (cb->b_type == BT_NAME)  {
-				if (cb->b_length != NAMEBLOCKLEN) {
-				    cb->b_byte = 0;
-				    cb->b_nbit = 0;
-				    cb->b_state = BS_NEED_SYNCBYTE;
-				    printf("TYPE: 0x%02x\n", cb->b_type);
-				    printf("Found bad block len, resetting\n");
-				} else 
-					cb->b_state = BS_NEED_NAME;
-			} else if (cb->b_type == BT_EOF) {
-				if (cb->b_length != 0) {
-				    cb->b_byte = 0;
-				    cb->b_nbit = 0;
-				    cb->b_state = BS_NEED_SYNCBYTE;
-				    printf("TYPE: 0x%02x\n", cb->b_type);
-				    printf("Found bad block len, resetting\n");
-				} else
-					cb->b_state = BS_NEED_CKSUM;
-			} else {
-				cb->b_state = BS_NEED_DATA;
-				cb->b_data = (uint8_t *)malloc(cb->b_length+1);
-				if (!cb->b_data) {
-					PRINT_ERROR("Data malloc failed\n");
-					return(1);
-				}
-				memset(cb->b_data, 0, cb->b_length+1);
-			}
-		}
-		cb->b_nbit++;
-		break;
-		
-	case BS_NEED_NAME:
-		if (cb->b_nbit == 8) {
-			if (d_debug)
-				printf("Found NAME BYTE: 0x%02x\n", cb->b_byte);
-			cb->b_progname[cb->b_progname_i++] = cb->b_byte;
-			cb->b_cksum += cb->b_byte;
-			if (cb->b_progname_i == PROGNAMELEN) {
-				if (d_debug)
-					printf("Name: %s\n", cb->b_progname);
-				cb->b_state = BS_NEED_FILETYPE;
-			}
-			
-			cb->b_byte = 0;
-			cb->b_nbit = 0;
-		}
-		cb->b_nbit++;
-		break;
-		
-	case BS_NEED_FILETYPE:
-		if (cb->b_nbit == 8) {
-			if (d_debug)
-				printf("Found FILETYPE: 0x%02x\n", cb->b_byte);
-			cb->b_filetype = cb->b_byte;
-			cb->b_cksum += cb->b_byte;
-			cb->b_state = BS_NEED_ASCIIFLAG;
-			
-			cb->b_byte = 0;
-			cb->b_nbit = 0;
-		}
-		cb->b_nbit++;
-		break;
-		
-	case BS_NEED_ASCIIFLAG:
-		if (cb->b_nbit == 8) {
-			if (d_debug)
-				printf("Found ASCIIFLAG: 0x%02x\n", cb->b_byte);
-			cb->b_asciiflag = cb->b_byte;
-			cb->b_cksum += cb->b_byte;
-			cb->b_state = BS_NEED_GAPFLAG;
-			
-			cb->b_byte = 0;
-			cb->b_nbit = 0;
-		}
-		cb->b_nbit++;
-		break;
-		
-	case BS_NEED_GAPFLAG:
-		if (cb->b_nbit == 8) {
-			if (d_debug)
-				printf("Found GAPFLAG: 0x%02x\n", cb->b_byte);
-			cb->b_gapflag = cb->b_byte;
-			cb->b_cksum += cb->b_byte;
-			cb->b_state = BS_NEED_STARTADDR;
-			
-			cb->b_byte = 0;
-			cb->b_nbit = 0;
-		}
-		cb->b_nbit++;
-		break;
-		
-	case BS_NEED_STARTADDR:
-		if (cb->b_nbit == 8) {
-			if (d_debug)
-				printf("Found START ADDR BYTE: 0x%02x\n",
-				       cb->b_byte);
-			cb->b_mlstart[cb->b_mlstart_i++] = cb->b_byte;
-			cb->b_cksum += cb->b_byte;
-			if (cb->b_mlstart_i == MLSTARTLEN) {
-				if (d_debug)
-					printf("Machine Language Start: 0x%04x\n",
-				       *(uint16_t *)cb->b_mlstart);
-				cb->b_state = BS_NEED_LOADADDR;
-			}
-			
-			cb->b_byte = 0;
-			cb->b_nbit = 0;
-		}
-		cb->b_nbit++;
-		break;
-		
-	case BS_NEED_LOADADDR:
-		if (cb->b_nbit == 8) {
-			if (d_debug)
-				printf("Found LOAD ADDR BYTE: 0x%02x\n",
-				       cb->b_byte);
-			cb->b_mlload[cb->b_mlload_i++] = cb->b_byte;
-			cb->b_cksum += cb->b_byte;
-			cb->b_length--;
-			if (cb->b_mlload_i == MLLOADLEN) {
-				if (d_debug)
-					printf("Machine Language Load: 0x%04x\n",
-					       *(uint16_t *)cb->b_mlload);
-				cb->b_state = BS_NEED_CKSUM;
-			}
-			cb->b_byte = 0;
-			cb->b_nbit = 0;
-		}
-		cb->b_nbit++;
-		break;
-		
-	case BS_NEED_DATA:
-		if (cb->b_nbit == 8) {
-			cb->b_data[cb->b_data_i++] = cb->b_byte;
-			cb->b_cksum += cb->b_byte;
-			if (cb->b_length == cb->b_data_i) {
-				if (d_debug) {
-					printf("Found DATA: \n");
-					printf("Length: 0x%02x\n",
-					       cb->b_data_i);
-					hexdump(cb->b_data, cb->b_data_i);
-				}
-				cb->b_state = BS_NEED_CKSUM;
-			}
-			
-			cb->b_byte = 0;
-			cb->b_nbit = 0;
-		}
-		cb->b_nbit++;
-		
-		break;
-		
-	case BS_NEED_CKSUM:
-		if (cb->b_nbit == 8) {
-			if (d_debug) {
-				printf("Found CKSUM: 0x%02x\n", cb->b_byte);
-				printf("Checksum: 0x%02x\n", cb->b_cksum);
-			}
-			if (cb->b_byte != cb->b_cksum) {
-				PRINT_ERROR("Decode Error: chksum\n");
-				return(1);
-			}
-			cb->b_state = BS_NEED_LEADBYTE;
-			
-			cb->b_byte = 0;
-			cb->b_nbit = 0;
-		}
-		cb->b_nbit++;
-		break;
-		
-	case BS_NEED_LEADBYTE:
-		if (cb->b_nbit == 8) {
-			if (d_debug)
-				printf("Found LEADBYTE: 0x%02x\n", cb->b_byte);
-			cb->b_byte = 0;
-			cb->b_nbit = 0;
-			cb->b_state = BS_DONE;
+	const int16_t	*data;
+	uint32_t	n;
+	int		rc = 0;
+
+	for (uint64_t j = wav->map ? start : 0;
+	     !rc && (j < end) && !cocotape_done(ctx); j += n) {
+		n = (end - j > WAV_CHUNK_SAMPLES) ? WAV_CHUNK_SAMPLES : end - j;
+		if (wav->map) {
+			/*
+			 * Mapped file, in place when the file is
+			 * already 16-bit mono.
+			 */
+			wav_readahead(wav, start, j);
+			data = wav_window(wav, j, n, chunk);
+		} else {
+			/* Stream, a fixed size chunk at a time */
+			if ((j < start) && (n > start - j))
+				n = start - j;
+			if (!(n = wav_read(wav, chunk, n)))
+				break;
+			if (j < start)
+				continue;
+			data = chunk;
 		}
-		cb->b_nbit++;
-		break;
-		
-	default:
-		PRINT_ERROR("Bad Block state\n");
-		return(1);
+
+		rc = cocotape_push_samples(ctx, data, n);
 	}
 
-	return(0);
+	return(rc);
 }
 
-/* 
- * Loads ONLY 16-bit 1-channel PCM .WAV files. 
- * Allocates sound->data and fills with the pcm data. 
- * Fills sound->samples with the number of ELEMENTS in sound->data. 
- * EG for 2-bytes per sample single channel, sound->samples = HALF 
- * of the number of bytes in sound->data.
+/* Parses a -S/-E position, samples or seconds followed by an s */
+bool
+wav_pos_parse(const char *arg, struct wav_pos *wp)
+{
+	char		*cp;
+
+	wp->wp_v = strtod(arg, &cp);
+	wp->wp_secs = (*cp == 's');
+	if ((cp == arg) || (wp->wp_v < 0) || (*cp && strcmp(cp, "s")) ||
+	    (!wp->wp_secs && (wp->wp_v != (uint32_t)wp->wp_v)))
+		return(false);
+	wp->wp_set = true;
+	return(true);
+}
+
+/* The sample a -S/-E position is at in wav, dflt if it wasn't given */
+uint32_t
+wav_pos(const struct wav_pos *wp, const sound_t *wav, uint32_t dflt)
+{
+	double		v;
+	uint32_t	max;
+
+	if (!wp->wp_set)
+		return(dflt);
+	max = (wav->map || wav->samples) ? wav->samples : UINT32_MAX;
+	v = wp->wp_secs ? wp->wp_v * wav->sample_rate : wp->wp_v;
+	return((v >= max) ? max : (uint32_t)v);
+}
+
+/*
+ * Times runs of pass two over the periods in pa with each variant, 
+ * quiet, best of runs, see BENCHMARKING above.
  */
-bool load_wav(const char *filename, sound_t *sound) {
-	bool return_value = true;
-	FILE *file;
-	char magic[4];
-	int32_t filesize;
-	int32_t format_length;		// 16
-	int16_t format_type;		// 1 = PCM
-	int16_t num_channels;		// 1
-	int32_t sample_rate;		// 44100
-	int32_t bytes_per_second;	// sample_rate * num_chans * bits_per_sample / 8
-	int16_t block_align;		// num_channels * bits_per_sample / 8
-	int16_t bits_per_sample;	// 16
-	int32_t data_size;
-
-	file = fopen(filename, "rb");
-	if(file == NULL) {
-		PRINT_ERROR("%s: Failed to open file", filename);
-		return false;
+void
+bench(const struct cocotape_config *cfg, const struct periods *pa, int runs)
+{
+	struct cocotape_config	bcfg = *cfg;
+	struct cocotape		*ctx;
+	struct timespec		t0, t1;
+	double			ns, best[2];
+
+	bcfg.sample_rate = pa->sample_rate;
+	bcfg.out = NULL;
+	bcfg.recover = true;
+	bcfg.keep = false;
+
+	for (int v = 0; v < 2; v++) {
+		best[v] = -1;
+		bcfg.instr = v;
+		for (int r = 0; r < runs; r++) {
+			if (!(ctx = cocotape_new(&bcfg)))
+				return;
+
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			cocotape_push_periods(ctx, pa->p, pa->n);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			cocotape_finish(ctx);
+			cocotape_free(ctx);
+
+			ns = (t1.tv_sec - t0.tv_sec) * 1e9 +
+				(t1.tv_nsec - t0.tv_nsec);
+			if (best[v] < 0 || ns < best[v])
+				best[v] = ns;
+		}
 	}
 
-	fread(magic, 1, 4, file);
-	if(magic[0] != 'R' || magic[1] != 'I' || magic[2] != 'F' || magic[3] != 'F') {
-		PRINT_ERROR("%s First 4 bytes should be \"RIFF\", are \"%4s\"", filename, magic);
-		return_value = false;
-		goto CLOSE_FILE;
-	}
+	printf("Bench: %u cycles, production %.2f ns/cycle, "
+	       "instrumented %.2f ns/cycle\n", pa->n,
+	       pa->n ? best[0] / pa->n : 0, pa->n ? best[1] / pa->n : 0);
+}
 
-	fread(&filesize, 4, 1, file);
+/* Shared by the sweep threads, the periods are only ever read */
+struct sweep {
+	struct cocotape_config	cfg;		/* What every setting starts from */
+	const struct periods	*pa;
+	struct sweep_cand	*cand;
+	uint32_t		ncand;
+	uint32_t		next;		/* Next candidate to run */
+};
 
-	fread(magic, 1, 4, file);
-	if(magic[0] != 'W' || magic[1] != 'A' || magic[2] != 'V' || magic[3] != 'E') {
-		PRINT_ERROR("%s 4 bytes should be \"WAVE\", are \"%4s\"", filename, magic);
-		return_value = false;
-		goto CLOSE_FILE;
+/* Runs candidates until there are none left */
+static void *
+sweep_worker(void *arg)
+{
+	struct sweep		*sw = arg;
+	struct sweep_cand	*c;
+	struct cocotape_config	cfg = sw->cfg;
+	struct cocotape		*ctx;
+	uint32_t		i;
+
+	while ((i = __atomic_fetch_add(&sw->next, 1, __ATOMIC_RELAXED)) <
+	       sw->ncand) {
+		c = &sw->cand[i];
+
+		cfg.one_low = c->o;
+		cfg.one_high = c->O;
+		cfg.zero_low = c->z;
+		cfg.zero_high = c->Z;
+		cfg.autocal = c->cal;
+
+		if (!(ctx = cocotape_new(&cfg)) ||
+		    cocotape_push_periods(ctx, sw->pa->p, sw->pa->n)) {
+			/* Out of memory, never a winner */
+			c->good = -1;
+		} else {
+			cocotape_stats(ctx, &c->good, &c->bad);
+		}
+		cocotape_free(ctx);
 	}
 
-	fread(magic, 1, 4, file);
-	if(magic[0] != 'f' || magic[1] != 'm' || magic[2] != 't' || magic[3] != ' ') {
-		PRINT_ERROR("%s 4 bytes should be \"fmt/0\", are \"%4s\"", filename, magic);
-		return_value = false;
-		goto CLOSE_FILE;
-	}
+	return(NULL);
+}
 
-	fread(&format_length, 4, 1, file);
-	fread(&format_type, 2, 1, file);
-	if(format_type != 1) {
-		PRINT_ERROR("%s format type should be 1, is %d", filename, format_type);
-		return_value = false;
-		goto CLOSE_FILE;
+/*
+ * Decodes the periods in pa with every setting in the -s grid on 
+ * nthreads threads, zero for one per cpu, and returns the best one,
+ * see SWEEPING above.
+ */
+int
+sweep(const struct cocotape_config *cfg, const struct periods *pa,
+      int nthreads, struct sweep_cand *best)
+{
+	struct sweep		sw;
+	struct sweep_cand	*c;
+	pthread_t		*tid;
+	uint32_t		i, b;
+	int			nt;
+
+	memset(&sw, 0, sizeof(sw));
+	sw.cfg = *cfg;
+	sw.cfg.sample_rate = pa->sample_rate;
+	sw.cfg.out = NULL;
+	sw.cfg.recover = true;
+	sw.cfg.keep = false;
+	sw.pa = pa;
+	sw.ncand = 2 + ((SWEEP_OL_MAX - SWEEP_OL_MIN) / SWEEP_OL_STEP + 1) *
+		(SWEEP_SPLIT_MAX - SWEEP_SPLIT_MIN + 1);
+	sw.cand = calloc(sw.ncand, sizeof(struct sweep_cand));
+	if (!sw.cand) {
+		PRINT_ERROR("Failed to malloc %u sweep settings", sw.ncand);
+		return(-1);
 	}
 
-	fread(&num_channels, 2, 1, file);
-	if(num_channels != 1) {
-		PRINT_ERROR("%s Number of channels should be 1, is %d", filename, num_channels);
-		return_value = false;
-		goto CLOSE_FILE;
+	/* What was asked for comes first, so it wins a tie */
+	c = sw.cand;
+	for (i = 0; i < 2; i++, c++) {
+		c->o = cfg->one_low;
+		c->O = cfg->one_high;
+		c->z = cfg->zero_low;
+		c->Z = cfg->zero_high;
+		c->cal = i ? !cfg->autocal : cfg->autocal;
 	}
-
-	fread(&sample_rate, 4, 1, file);
-	if(sample_rate != 44100) {
-		PRINT_ERROR("%s Sample rate should be 44100, is %d", filename, sample_rate);
-		return_value = false;
-		goto CLOSE_FILE;
+	for (int o = SWEEP_OL_MIN; o <= SWEEP_OL_MAX; o += SWEEP_OL_STEP) {
+		for (int split = SWEEP_SPLIT_MIN; split <= SWEEP_SPLIT_MAX;
+		     split++, c++) {
+			c->o = o;
+			c->O = split;
+			c->z = split + 1;
+			c->Z = cfg->zero_high;
+		}
 	}
 
-	fread(&bytes_per_second, 4, 1, file);
-	fread(&block_align, 2, 1, file);
-	fread(&bits_per_sample, 2, 1, file);
-	if(bits_per_sample != 16) {
-		PRINT_ERROR("%s bits per sample should be 16, is %d", filename, bits_per_sample);
-		return_value = false;
-		goto CLOSE_FILE;
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
+	if (nthreads > sw.ncand)
+		nthreads = sw.ncand;
+
+	tid = calloc(nthreads, sizeof(pthread_t));
+	if (!tid) {
+		PRINT_ERROR("Failed to malloc %d threads", nthreads);
+		free(sw.cand);
+		return(-1);
 	}
 
-	fread(magic, 1, 4, file);
-	if(magic[0] != 'd' || magic[1] != 'a' || magic[2] != 't' || magic[3] != 'a') {
-		PRINT_ERROR("%s 4 bytes should be \"data\", are \"%4s\"", filename, magic);
-		return_value = false;
-		goto CLOSE_FILE;
+	/* Whatever threads can't be had, this one makes up for */
+	for (nt = 0; nt < nthreads - 1; nt++)
+		if (pthread_create(&tid[nt], NULL, sweep_worker, &sw))
+			break;
+	sweep_worker(&sw);
+	while (nt--)
+		pthread_join(tid[nt], NULL);
+	free(tid);
+
+	for (i = 0, b = 0; i < sw.ncand; i++) {
+		c = &sw.cand[i];
+		if (v_verbose)
+			printf("Sweep: -o %d -O %d -z %d -Z %d%s %d good %d bad\n",
+			       c->o, c->O, c->z, c->Z, c->cal ? " -a" : "",
+			       c->good, c->bad);
+		if ((c->good > sw.cand[b].good) ||
+		    ((c->good == sw.cand[b].good) && (c->bad < sw.cand[b].bad)))
+			b = i;
 	}
 
-	fread(&data_size, 4, 1, file);
-	sound->data = malloc(data_size);
-	if(sound->data == NULL) {
-		PRINT_ERROR("%s Failed to allocate %d bytes for data", filename, data_size);
-		return_value = false;
-		goto CLOSE_FILE;
-	}
+	*best = sw.cand[b];
+	free(sw.cand);
 
-	if(fread(sound->data, 1, data_size, file) != data_size) {
-		PRINT_ERROR("%s Failed to read data bytes", filename);
-		return_value = false;
-		free(sound->data);
-		goto CLOSE_FILE;
+	if (best->good < 0) {
+		PRINT_ERROR("Sweep failed");
+		return(-1);
 	}
 
-	sound->samples = data_size / 2;
+	printf("Swept %u settings on %d threads, best -o %d -O %d -z %d -Z %d%s:"
+	       " %d good blocks, %d bad\n", sw.ncand, nthreads, best->o,
+	       best->O, best->z, best->Z, best->cal ? " -a" : "", best->good,
+	       best->bad);
 
-	CLOSE_FILE:
-	fclose(file);
+	return(0);
+}
 
-	return return_value;
+/* Appends a place the recording could be cut at, growing as needed */
+static bool
+cuts_add(uint32_t **cand, uint32_t *n, uint32_t *cap, uint32_t sample)
+{
+	uint32_t	*nc;
+
+	if (*n == *cap) {
+		*cap = *cap ? *cap * 2 : 64;
+		if (!(nc = realloc(*cand, *cap * sizeof(uint32_t))))
+			return(false);
+		*cand = nc;
+	}
+	(*cand)[(*n)++] = sample;
+	return(true);
 }
 
+static int
+cuts_cmp(const void *a, const void *b)
+{
+	uint32_t	x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return((x > y) - (x < y));
+}
 
-void
-hexdump(const void* data, size_t size)
+/*
+ * Finds where a recording can be cut into pieces that decode on their
+ * own, see SPLITTING above: the middle of quiet gaps of at least 
+ * GAP_MIN_MS and the middle of leader runs of at least LEADER_CYCLES.
+ * A piece is only cut off once it is every samples long. Writes the
+ * sample each piece after the first starts at to cut, at most maxcut
+ * of them, and returns how many.
+ */
+uint32_t
+wav_cuts(sound_t *wav, uint32_t every, uint32_t *cut, uint32_t maxcut,
+	 int16_t *chunk)
 {
-	char offset[10];	/* Byte Offset string */
-	char line[81];		/* Current line */
-	char lline[81];		/* Last line for comparison */
-#define SEPSTR " |  "
-	char sep[81];		/* Built separator string */
-	char hexch[5];		/* Formatted hex character */
-	size_t lines, l, i, j, bpl=16, lb, bsl=3, lo, repeat = 0;
+	const int16_t	*data;
+	uint16_t	*peak, top = 0;
+	uint32_t	win, nwin, w, n, run, minrun, stride, ncut = 0;
+	uint32_t	*cand = NULL, ncand = 0, candcap = 0;
+	uint32_t	x, xlast = 0, per, plast = 0, lo, hi;
+	uint32_t	lrun = 0, lstart = 0;
+	uint64_t	last = 0, len, k;
+	int16_t		prev = 0;
+	bool		up, lup = false, ok = true;
+	int		a;
+
+	win = wav->sample_rate / (1000 / GAP_WIN_MS);
+	nwin = wav->samples / win;
+	len = (uint64_t)nwin * win;
+	minrun = GAP_MIN_MS / GAP_WIN_MS;
+	stride = (uint64_t)GAP_STRIDE * wav->sample_rate / GAP_STRIDE_RATE;
+	if (!stride)
+		stride = 1;
+	if (!wav->map || !nwin || !maxcut)
+		return(0);
+	if (!(peak = calloc(nwin, sizeof(uint16_t))))
+		return(0);
 
 	/*
-	 * dump the output line by line. This way if lines are
-	 * repeated they can be detected and not printed again.
-	 * The hex portion is a little inefficient as it is O(x^2)
-	 * but is simple to read.
-	 *
-	 * bpl is Bytes per Line
-	 * lb is Line Bytes, mostly lb = bpl except for last line
-	 * bsl is Byte String Length, length of single byte in ascii + " "
-	 * lo is Line Offset
+	 * Loudest sample of each window and the falling crossings, both
+	 * off every stride'th sample. That still sees both halves of a
+	 * 2400Hz cycle, so no crossing is missed, only placed less exactly.
 	 */
-	lines = (size / bpl) + ((size % bpl)?1:0);
-	lline[0] = '\0';
-	lb = bpl;
-	for (l=0,i=0; l<lines; i+=lb, l++) {
-
-		/* Last line update bpl if necessary */
-		if (l == (lines - 1))
-			if (size % bpl)
-				lb = size % bpl;
-
-		/* Offset */
-		sprintf(offset, "%08x ", (unsigned int)(l * bpl));
-
-		/* Hex dump */
-		line[0] = '\0';
-		for (j = 0; j < lb; ++j) {
-			sprintf(hexch, "%02X ", ((unsigned char*)data)[i+j]);
-			strcat(line, hexch);
-		}
-
-		/* Add Hex Ascii Separator, variable width */
-		sprintf(sep, "%*s",
-			(int)(((bpl - lb) * bsl) + strlen(SEPSTR)), SEPSTR);
-		strcat(line, sep);
+	for (uint64_t j = 0; ok && j < len; j += n) {
+		n = (len - j > WAV_CHUNK_SAMPLES) ? WAV_CHUNK_SAMPLES : len - j;
+		data = wav_window(wav, j, n, chunk);
+		for (k = (stride - j % stride) % stride; k < n; k += stride) {
+			w = (j + k) / win;
+			a = abs(data[k]);
+			if (a > peak[w])
+				peak[w] = a;
+
+			if ((data[k] >= 0) || (prev < 0)) {
+				prev = data[k];
+				continue;
+			}
+			prev = data[k];
 
-		/* Ascii dump */
-		lo = strlen(line);
-		for (j = 0; j < lb; ++j) {
-			if (isprint(((unsigned char *)data)[i+j]))
-				line[lo] = ((char *)data)[i+j];
-			else
-				line[lo] = '.';
-			lo++;
+			/*
+			 * A leader alternates short and long periods, as
+			 * calibrating in the decoder looks for them.
+			 */
+			x = j + k;
+			per = x - xlast;
+			xlast = x;
+			up = (per > plast);
+			lo = up ? plast : per;
+			hi = up ? per : plast;
+			if ((hi * 10 >= lo * LEADER_RATIO_LO) &&
+			    (hi * 10 <= lo * LEADER_RATIO_HI) &&
+			    (!lrun || up != lup)) {
+				if (!lrun++)
+					lstart = x - per;
+			} else {
+				/* The run ended at the crossing before */
+				if (lrun >= LEADER_CYCLES)
+					ok = cuts_add(&cand, &ncand, &candcap,
+						      lstart + (x - per -
+								lstart) / 2);
+				lrun = 0;
+			}
+			lup = up;
+			plast = per;
+		}
+	}
+	for (w = 0; w < nwin; w++)
+		if (peak[w] > top)
+			top = peak[w];
+
+	/* Quiet is well under the loudest the tape gets */
+	run = 0;
+	for (w = 0; ok && w <= nwin; w++) {
+		if ((w < nwin) && (peak[w] < top / GAP_RATIO)) {
+			run++;
+			continue;
 		}
-		line[lo] = '\0';
+		if (run >= minrun)
+			ok = cuts_add(&cand, &ncand, &candcap,
+				      (uint64_t)(w - run / 2) * win);
+		run = 0;
+	}
 
-		/* check if repeated */
-		if (strcmp(line, lline)) {
-			/* Non repeated line, print it */
-			if (repeat)
-				printf("    Last line repeated %ld time(s)\n",
-				       repeat);
+	/* Taken in tape order, the first far enough past the last cut */
+	if (ok)
+		qsort(cand, ncand, sizeof(uint32_t), cuts_cmp);
+	for (uint32_t i = 0; ok && i < ncand && ncut < maxcut; i++) {
+		if (cand[i] - last < every)
+			continue;
+		last = cand[i];
+		cut[ncut++] = last;
+	}
 
-			printf("%s%s\n", offset, line);
+	free(cand);
+	free(peak);
+	return(ok ? ncut : 0);
+}
 
-			/* Save last line */
-			strcpy(lline, line);
-			repeat = 0;
-		} else {
-			/* Repeated, don't print just count */
-			repeat++;
+/*
+ * A piece of a batch file, decoded on its own into blocks that are put
+ * back together with the other pieces' in tape order.
+ */
+struct batch_seg {
+	struct batch_file *bs_file;
+	uint32_t	bs_start, bs_end;	/* Samples, [start, end) */
+	struct block	*bs_blocks;
+	uint32_t	bs_nblk, bs_cap;
+	int		bs_rc;
+	bool		bs_busy;	/* Cut part way through a block */
+};
+
+/* A file of a batch and where its listing goes */
+struct batch_file {
+	const char	*bf_name;
+	sound_t		bf_wav;
+	struct batch_seg *bf_seg;
+	uint32_t	bf_nseg;
+	uint32_t	bf_left;	/* Pieces still decoding */
+	char		*bf_buf;	/* Listing, when in input order */
+	size_t		bf_len;
+	struct tape_index bf_idx;	/* With -X */
+	int		bf_rc;
+	bool		bf_done;	/* Under batch.lock */
+};
+
+/* A job, a file to open or a piece of one to decode */
+struct batch_job {
+	struct batch_file *bj_file;
+	struct batch_seg *bj_seg;	/* NULL to open the file */
+};
+
+/*
+ * Each worker's jobs. The worker takes the newest off the tail, idle
+ * workers steal the oldest off the head.
+ */
+struct batch_deque {
+	pthread_mutex_t	bd_lock;
+	struct batch_job *bd_jobs;
+	uint32_t	bd_head, bd_tail, bd_cap;
+};
+
+struct batch {
+	struct cocotape_config cfg;
+	const char	*outdir;	/* Per file listings, NULL for stdout */
+	bool		index;		/* Write a tape index per file */
+	struct batch_file *files;
+	uint32_t	nfiles;
+	struct batch_deque *dq;
+	int		nworkers;
+	uint32_t	pending;	/* Jobs queued or running */
+	uint32_t	pushed;		/* Jobs ever queued */
+	pthread_mutex_t	lock;
+	pthread_cond_t	done;		/* A file's listing is ready */
+	pthread_cond_t	work;		/* A job was pushed, or none are left */
+};
+
+/* Shared by batch_worker() and the threads running it */
+struct batch_arg {
+	struct batch	*b;
+	int		id;
+};
+
+static bool
+batch_push(struct batch *b, int id, struct batch_file *f,
+	   struct batch_seg *seg)
+{
+	struct batch_deque *dq = &b->dq[id];
+	struct batch_job *jobs;
+	uint32_t	cap;
+
+	pthread_mutex_lock(&dq->bd_lock);
+	if (dq->bd_tail == dq->bd_cap) {
+		/* Slide down over what was stolen before growing */
+		memmove(dq->bd_jobs, dq->bd_jobs + dq->bd_head,
+			(dq->bd_tail - dq->bd_head) * sizeof(struct batch_job));
+		dq->bd_tail -= dq->bd_head;
+		dq->bd_head = 0;
+	}
+	if (dq->bd_tail == dq->bd_cap) {
+		cap = dq->bd_cap ? dq->bd_cap * 2 : 64;
+		jobs = realloc(dq->bd_jobs, cap * sizeof(struct batch_job));
+		if (!jobs) {
+			pthread_mutex_unlock(&dq->bd_lock);
+			return(false);
+		}
+		dq->bd_jobs = jobs;
+		dq->bd_cap = cap;
+	}
+	__atomic_add_fetch(&b->pending, 1, __ATOMIC_SEQ_CST);
+	dq->bd_jobs[dq->bd_tail].bj_file = f;
+	dq->bd_jobs[dq->bd_tail].bj_seg = seg;
+	dq->bd_tail++;
+	pthread_mutex_unlock(&dq->bd_lock);
+
+	/* Wakes a worker waiting in batch_worker() */
+	pthread_mutex_lock(&b->lock);
+	__atomic_add_fetch(&b->pushed, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_signal(&b->work);
+	pthread_mutex_unlock(&b->lock);
+
+	return(true);
+}
+
+/* Takes a job off the tail of worker id's own jobs, or steal's head */
+static bool
+batch_take(struct batch *b, int id, bool steal, struct batch_job *job)
+{
+	struct batch_deque *dq = &b->dq[id];
+	bool		got = false;
+
+	pthread_mutex_lock(&dq->bd_lock);
+	if (dq->bd_head < dq->bd_tail) {
+		*job = steal ? dq->bd_jobs[dq->bd_head++] :
+			dq->bd_jobs[--dq->bd_tail];
+		got = true;
+	}
+	pthread_mutex_unlock(&dq->bd_lock);
+
+	return(got);
+}
+
+/* Keeps a copy of every block a piece's decoder reads */
+static void
+batch_block(void *arg, const struct block *blk)
+{
+	struct batch_seg *seg = arg;
+	struct block	*nb;
+	uint32_t	cap;
+
+	if (seg->bs_nblk == seg->bs_cap) {
+		cap = seg->bs_cap ? seg->bs_cap * 2 : 64;
+		nb = realloc(seg->bs_blocks, cap * sizeof(struct block));
+		if (!nb) {
+			seg->bs_rc = -1;
+			return;
+		}
+		seg->bs_blocks = nb;
+		seg->bs_cap = cap;
+	}
+	nb = &seg->bs_blocks[seg->bs_nblk++];
+	*nb = *blk;
+
+	/* The piece's decoder counts from where it starts */
+	nb->b_start += seg->bs_start;
+	nb->b_end += seg->bs_start;
+}
+
+/* The file's listing is done, frees what it held and lets main know */
+static void
+batch_file_done(struct batch *b, struct batch_file *f, FILE *out)
+{
+	if (out && out != stdout)
+		fclose(out);
+	for (uint32_t i = 0; i < f->bf_nseg; i++)
+		free(f->bf_seg[i].bs_blocks);
+	free(f->bf_seg);
+	f->bf_seg = NULL;
+	unload_wav(&f->bf_wav);
+
+	pthread_mutex_lock(&b->lock);
+	f->bf_done = true;
+	pthread_cond_broadcast(&b->done);
+	pthread_mutex_unlock(&b->lock);
+}
+
+/* Where a file's listing goes, its own file or a buffer for stdout */
+static FILE *
+batch_out(struct batch *b, struct batch_file *f)
+{
+	const char	*base, *dot;
+	char		path[PATH_MAX];
+	FILE		*out;
+	int		len;
+
+	if (!b->outdir)
+		return(open_memstream(&f->bf_buf, &f->bf_len));
+
+	/* dir/NAME.txt for dir/or/not/NAME.wav */
+	base = strrchr(f->bf_name, '/');
+	base = base ? base + 1 : f->bf_name;
+	dot = strrchr(base, '.');
+	len = dot ? dot - base : (int)strlen(base);
+	if (snprintf(path, sizeof(path), "%s/%.*s.txt", b->outdir, len,
+		     base) >= sizeof(path)) {
+		fprintf(stderr, "**** %s: Output name too long\n", f->bf_name);
+		return(NULL);
+	}
+	if (!(out = fopen(path, "w")))
+		fprintf(stderr, "**** %s: Failed to create %s\n", f->bf_name,
+			path);
+
+	return(out);
+}
+
+/*
+ * Decodes a piece of a file on its own, its blocks into the piece,
+ * bad ones too, the listing decoder stops at one without -r.
+ * The last bit before a gap is only counted at the first crossing
+ * after it, which for a piece cut short is in the next piece, or for
+ * the last one never comes. That crossing's period is the whole gap,
+ * saturated, as cocotape_finish() does for the end of the recording.
+ */
+static void
+batch_piece(struct batch *b, struct batch_seg *seg, int16_t *chunk)
+{
+	struct cocotape_config cfg = b->cfg;
+	struct batch_file *f = seg->bs_file;
+	struct cocotape	*ctx;
+	uint16_t	gap = PERIOD_MAX;
+
+	cfg.sample_rate = f->bf_wav.sample_rate;
+	cfg.out = NULL;
+	cfg.recover = true;
+	cfg.on_block = batch_block;
+	cfg.arg = seg;
+
+	seg->bs_nblk = 0;
+	if (!(ctx = cocotape_new(&cfg)) ||
+	    decode_wav(&f->bf_wav, ctx, seg->bs_start, seg->bs_end, chunk) ||
+	    cocotape_push_periods(ctx, &gap, 1))
+		seg->bs_rc = -1;
+	else
+		seg->bs_busy = !cocotape_idle(ctx);
+	cocotape_free(ctx);
+}
+
+/*
+ * Every piece of the file is decoded, put their blocks back together
+ * in tape order and list the programs. A piece cut off part way 
+ * through a block is first decoded again along with the pieces after
+ * it up to one that wasn't. A file that was not cut is decoded here,
+ * straight through.
+ */
+static void
+batch_stitch(struct batch *b, struct batch_file *f, int16_t *chunk)
+{
+	struct cocotape_config cfg = b->cfg;
+	struct cocotape	*ctx;
+	struct batch_seg *seg;
+	uint32_t	j;
+	FILE		*out;
+
+	if (!(out = batch_out(b, f))) {
+		f->bf_rc = 1;
+		batch_file_done(b, f, NULL);
+		return;
+	}
+
+	cfg.sample_rate = f->bf_wav.sample_rate;
+	cfg.out = out;
+	if (b->index) {
+		index_init(&f->bf_idx, &f->bf_wav);
+		cfg.on_block = index_block;
+		cfg.arg = &f->bf_idx;
+	}
+	if (!(ctx = cocotape_new(&cfg))) {
+		f->bf_rc = 1;
+		batch_file_done(b, f, out);
+		return;
+	}
+
+	if (!f->bf_nseg && decode_wav(&f->bf_wav, ctx, 0, f->bf_wav.samples,
+				      chunk))
+		f->bf_rc = 1;
+	for (uint32_t i = 0; i < f->bf_nseg; i = j) {
+		seg = &f->bf_seg[i];
+
+		/*
+		 * The pieces after a busy one started part way through a
+		 * block, whatever they failed on is down to the cut, not
+		 * the tape. Decoded again as one up to a piece ending idle.
+		 */
+		for (j = i + 1; !seg->bs_rc && seg->bs_busy &&
+		     (j < f->bf_nseg); ) {
+			seg->bs_end = f->bf_seg[j].bs_end;
+			if ((++j < f->bf_nseg) &&
+			    (f->bf_seg[j - 1].bs_rc || f->bf_seg[j - 1].bs_busy))
+				continue;
+			batch_piece(b, seg, chunk);
+		}
+		/* A bad block without -r stops it as a single decode */
+		if (cocotape_push_blocks(ctx, seg->bs_blocks, seg->bs_nblk)) {
+			f->bf_rc = 1;
+			break;
+		}
+		if (seg->bs_rc) {
+			fprintf(out, "**** %s: Decode failed after %u samples\n",
+				f->bf_name, seg->bs_end);
+			f->bf_rc = 1;
+			break;
+		}
+	}
+
+	if (!f->bf_rc && cocotape_finish(ctx))
+		f->bf_rc = 1;
+	cocotape_free(ctx);
+	if (b->index && !index_save(f->bf_name, &f->bf_idx))
+		f->bf_rc = 1;
+	index_free(&f->bf_idx);
+	batch_file_done(b, f, out);
+}
+
+/* Decodes a piece of a file, the last piece done stitches them */
+static void
+batch_decode(struct batch *b, struct batch_seg *seg, int16_t *chunk)
+{
+	struct batch_file *f = seg->bs_file;
+
+	batch_piece(b, seg, chunk);
+	if (!__atomic_sub_fetch(&f->bf_left, 1, __ATOMIC_ACQ_REL))
+		batch_stitch(b, f, chunk);
+}
+
+/*
+ * Loads a file and cuts it into pieces, see SPLITTING above, so no one
+ * file holds up the end of the batch. The first piece is decoded right
+ * here, the rest are left for whoever gets to them.
+ */
+static void
+batch_open(struct batch *b, int id, struct batch_file *f, int16_t *chunk)
+{
+	uint32_t	every, ncut, *cut;
+
+	if (!load_wav(f->bf_name, &f->bf_wav)) {
+		f->bf_rc = 1;
+		batch_file_done(b, f, NULL);
+		return;
+	}
+
+	every = f->bf_wav.samples / b->nworkers;
+	if (every < f->bf_wav.sample_rate * SPLIT_MIN_SECS)
+		every = f->bf_wav.sample_rate * SPLIT_MIN_SECS;
+	if (every > f->bf_wav.sample_rate * SPLIT_MAX_SECS)
+		every = f->bf_wav.sample_rate * SPLIT_MAX_SECS;
+	ncut = (b->nworkers > 1) ? f->bf_wav.samples / every : 0;
+	cut = calloc(ncut + 1, sizeof(uint32_t));
+	if (!cut) {
+		f->bf_rc = 1;
+		batch_file_done(b, f, NULL);
+		return;
+	}
+	if (ncut)
+		ncut = wav_cuts(&f->bf_wav, every, cut, ncut, chunk);
+	if (!ncut) {
+		/* Nothing to share out, decoded as it would be alone */
+		free(cut);
+		batch_stitch(b, f, chunk);
+		return;
+	}
+	if (!(f->bf_seg = calloc(ncut + 1, sizeof(struct batch_seg)))) {
+		free(cut);
+		f->bf_rc = 1;
+		batch_file_done(b, f, NULL);
+		return;
+	}
+	cut[ncut] = f->bf_wav.samples;
+
+	f->bf_nseg = ncut + 1;
+	f->bf_left = f->bf_nseg;
+	for (uint32_t i = 0; i < f->bf_nseg; i++) {
+		f->bf_seg[i].bs_file = f;
+		f->bf_seg[i].bs_start = i ? cut[i - 1] : 0;
+		f->bf_seg[i].bs_end = cut[i];
+	}
+	free(cut);
+
+	/* Pushed newest last, so this worker works front to back */
+	for (uint32_t i = f->bf_nseg - 1; i > 0; i--)
+		if (!batch_push(b, id, f, &f->bf_seg[i]))
+			batch_decode(b, &f->bf_seg[i], chunk);
+	batch_decode(b, &f->bf_seg[0], chunk);
+}
+
+static void *
+batch_worker(void *arg)
+{
+	struct batch_arg *ba = arg;
+	struct batch	*b = ba->b;
+	struct batch_job job;
+	int16_t		*chunk;
+	uint32_t	pushed;
+	bool		got;
+
+	if (!(chunk = malloc(WAV_CHUNK_SAMPLES * sizeof(int16_t)))) {
+		PRINT_ERROR("Failed to allocate worker %d", ba->id);
+		return(NULL);
+	}
+
+	for (;;) {
+		pushed = __atomic_load_n(&b->pushed, __ATOMIC_SEQ_CST);
+		if (!__atomic_load_n(&b->pending, __ATOMIC_SEQ_CST))
+			break;
+		got = batch_take(b, ba->id, false, &job);
+		for (int v = 1; !got && v < b->nworkers; v++)
+			got = batch_take(b, (ba->id + v) % b->nworkers, true,
+					 &job);
+		if (!got) {
+			/*
+			 * Everything left is running somewhere else, wait
+			 * for it to push more or for the last to finish.
+			 */
+			pthread_mutex_lock(&b->lock);
+			while ((__atomic_load_n(&b->pushed, __ATOMIC_SEQ_CST) ==
+				pushed) &&
+			       __atomic_load_n(&b->pending, __ATOMIC_SEQ_CST))
+				pthread_cond_wait(&b->work, &b->lock);
+			pthread_mutex_unlock(&b->lock);
+			continue;
+		}
+
+		if (job.bj_seg)
+			batch_decode(b, job.bj_seg, chunk);
+		else
+			batch_open(b, ba->id, job.bj_file, chunk);
+		if (!__atomic_sub_fetch(&b->pending, 1, __ATOMIC_SEQ_CST)) {
+			pthread_mutex_lock(&b->lock);
+			pthread_cond_broadcast(&b->work);
+			pthread_mutex_unlock(&b->lock);
+		}
+	}
+
+	free(chunk);
+	return(NULL);
+}
+
+/*
+ * Decodes the nfiles WAVs in names on nthreads threads, zero for one
+ * per cpu, see BATCH above. Listings to stdout go after a "File:" line
+ * if titled. With index a tape index is written next to each. Returns
+ * non-zero if any of them failed.
+ */
+int
+batch(const struct cocotape_config *cfg, char **names, uint32_t nfiles,
+      const char *outdir, bool titled, bool index, int nthreads)
+{
+	struct batch	b;
+	struct batch_arg *ba;
+	pthread_t	*tid;
+	int		nt, rc = 0;
+
+	memset(&b, 0, sizeof(b));
+	b.cfg = *cfg;
+	b.cfg.keep = false;
+	b.outdir = outdir;
+	b.index = index;
+	b.nfiles = nfiles;
+
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
+	b.nworkers = nthreads;
+
+	b.files = calloc(nfiles, sizeof(struct batch_file));
+	b.dq = calloc(nthreads, sizeof(struct batch_deque));
+	ba = calloc(nthreads, sizeof(struct batch_arg));
+	tid = calloc(nthreads, sizeof(pthread_t));
+	if (!b.files || !b.dq || !ba || !tid) {
+		PRINT_ERROR("Failed to malloc a batch of %u", nfiles);
+		return(-1);
+	}
+	pthread_mutex_init(&b.lock, NULL);
+	pthread_cond_init(&b.done, NULL);
+	pthread_cond_init(&b.work, NULL);
+	for (int i = 0; i < nthreads; i++)
+		pthread_mutex_init(&b.dq[i].bd_lock, NULL);
+
+	/* Dealt out round robin, stealing evens out the rest */
+	for (uint32_t i = 0; i < nfiles; i++) {
+		b.files[i].bf_name = names[i];
+		if (!batch_push(&b, i % nthreads, &b.files[i], NULL)) {
+			PRINT_ERROR("Failed to queue %s", names[i]);
+			return(-1);
+		}
+	}
+
+	for (nt = 0; nt < nthreads; nt++) {
+		ba[nt].b = &b;
+		ba[nt].id = nt;
+		if (pthread_create(&tid[nt], NULL, batch_worker, &ba[nt]))
+			break;
+	}
+	if (!nt) {
+		/* No threads to be had, do it all here */
+		batch_worker(&ba[0]);
+	}
+
+	/* Listings in input order, each as soon as it and those before are */
+	for (uint32_t i = 0; i < nfiles; i++) {
+		struct batch_file *f = &b.files[i];
+
+		pthread_mutex_lock(&b.lock);
+		while (!f->bf_done)
+			pthread_cond_wait(&b.done, &b.lock);
+		pthread_mutex_unlock(&b.lock);
+
+		if (!outdir) {
+			if (titled)
+				printf("File: %s\n", f->bf_name);
+			fwrite(f->bf_buf, 1, f->bf_len, stdout);
+			fflush(stdout);
+		}
+		free(f->bf_buf);
+		if (f->bf_rc)
+			rc = 1;
+	}
+
+	while (nt--)
+		pthread_join(tid[nt], NULL);
+	for (int i = 0; i < nthreads; i++) {
+		pthread_mutex_destroy(&b.dq[i].bd_lock);
+		free(b.dq[i].bd_jobs);
+	}
+	pthread_cond_destroy(&b.done);
+	pthread_cond_destroy(&b.work);
+	pthread_mutex_destroy(&b.lock);
+	free(tid);
+	free(ba);
+	free(b.dq);
+	free(b.files);
+
+	return(rc);
+}
+
+/* Appends name to the list, growing it as needed */
+static bool
+names_add(char ***names, uint32_t *n, uint32_t *cap, const char *name)
+{
+	char		**nn;
+
+	if (*n == *cap) {
+		*cap = *cap ? *cap * 2 : 64;
+		if (!(nn = realloc(*names, *cap * sizeof(char *))))
+			return(false);
+		*names = nn;
+	}
+	return(((*names)[(*n)++] = strdup(name)) != NULL);
+}
+
+static int
+names_cmp(const void *a, const void *b)
+{
+	return(strcmp(*(char * const *)a, *(char * const *)b));
+}
+
+/*
+ * The .wav files in directory dir, sorted, or the files listed one per
+ * line in list, - for stdin. Returns how many, -1 on error.
+ */
+int
+batch_names(const char *dir, const char *list, char ***names)
+{
+	DIR		*d;
+	struct dirent	*de;
+	FILE		*file;
+	char		*line = NULL, path[PATH_MAX];
+	size_t		cap = 0, len;
+	ssize_t		got;
+	uint32_t	n = 0, ncap = 0;
+	bool		ok = true;
+
+	*names = NULL;
+
+	if (dir) {
+		if (!(d = opendir(dir))) {
+			fprintf(stderr, "**** %s: Failed to open directory\n",
+				dir);
+			return(-1);
+		}
+		while (ok && (de = readdir(d))) {
+			len = strlen(de->d_name);
+			if (len < 5 || strcasecmp(de->d_name + len - 4, ".wav"))
+				continue;
+			if (snprintf(path, sizeof(path), "%s/%s", dir,
+				     de->d_name) >= sizeof(path))
+				continue;
+			ok = names_add(names, &n, &ncap, path);
+		}
+		closedir(d);
+		if (ok)
+			qsort(*names, n, sizeof(char *), names_cmp);
+	} else {
+		file = strcmp(list, "-") ? fopen(list, "r") : stdin;
+		if (!file) {
+			fprintf(stderr, "**** %s: Failed to open list\n", list);
+			return(-1);
+		}
+		while (ok && (got = getline(&line, &cap, file)) >= 0) {
+			while (got && (line[got - 1] == '\n' ||
+				       line[got - 1] == '\r'))
+				line[--got] = '\0';
+			if (got)
+				ok = names_add(names, &n, &ncap, line);
+		}
+		free(line);
+		if (file != stdin)
+			fclose(file);
+	}
+
+	if (!ok) {
+		PRINT_ERROR("Failed to malloc file names");
+		return(-1);
+	}
+	return(n);
+}
+
+/*
+ * SAMPLE CONVERTERS
+ * Every format is brought down to signed 16-bit, keeping only the
+ * selected channel. The zero crossing detector only cares about the
+ * sign, so wider samples just drop their low bits and floats are
+ * floored so a tiny negative value stays negative.
+ *
+ * The plain C versions handle any frame size. Where the frame layout is
+ * common (mono, or 16-bit stereo) there are SSE2 and AVX2 versions,
+ * AVX2 being picked at runtime only if the CPU has it. These do whole
+ * vectors and leave the remainder to the C version.
+ */
+
+/* Byte offset of the selected channel within a frame */
+static inline uint32_t
+wav_chan_offset(const sound_t *sound)
+{
+	return(sound->channel * (sound->bits_per_sample / 8));
+}
+
+static void
+conv_u8(const uint8_t *src, int16_t *dst, uint32_t n, uint32_t stride)
+{
+	for (uint32_t i = 0; i < n; i++, src += stride)
+		dst[i] = (int16_t)((*src - 128) << 8);
+}
+
+static void
+conv_s16(const uint8_t *src, int16_t *dst, uint32_t n, uint32_t stride)
+{
+	for (uint32_t i = 0; i < n; i++, src += stride)
+		memcpy(&dst[i], src, sizeof(int16_t));
+}
+
+static void
+conv_s24(const uint8_t *src, int16_t *dst, uint32_t n, uint32_t stride)
+{
+	for (uint32_t i = 0; i < n; i++, src += stride)
+		dst[i] = (int16_t)(src[1] | (src[2] << 8));
+}
+
+static void
+conv_s32(const uint8_t *src, int16_t *dst, uint32_t n, uint32_t stride)
+{
+	int32_t v;
+
+	for (uint32_t i = 0; i < n; i++, src += stride) {
+		memcpy(&v, src, sizeof(v));
+		dst[i] = (int16_t)(v >> 16);
+	}
+}
+
+static void
+conv_f32(const uint8_t *src, int16_t *dst, uint32_t n, uint32_t stride)
+{
+	float f;
+	int32_t v;
+
+	for (uint32_t i = 0; i < n; i++, src += stride) {
+		memcpy(&f, src, sizeof(f));
+		f *= 32767.0f;
+		if (f >= 32767.0f)
+			v = 32767;
+		else if (f <= -32768.0f)
+			v = -32768;
+		else {
+			/* floor, not truncate, so the sign survives */
+			v = (int32_t)f;
+			if (v > f)
+				v--;
+		}
+		dst[i] = (int16_t)v;
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+static void
+conv_u8_sse2(const uint8_t *src, int16_t *dst, uint32_t n, uint32_t stride)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i bias = _mm_set1_epi16(128);
+	uint32_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i lo = _mm_unpacklo_epi8(v, zero);
+		__m128i hi = _mm_unpackhi_epi8(v, zero);
+
+		lo = _mm_slli_epi16(_mm_sub_epi16(lo, bias), 8);
+		hi = _mm_slli_epi16(_mm_sub_epi16(hi, bias), 8);
+		_mm_storeu_si128((__m128i *)(dst + i), lo);
+		_mm_storeu_si128((__m128i *)(dst + i + 8), hi);
+	}
+	conv_u8(src + i, dst + i, n - i, stride);
+}
+
+/*
+ * Low 16 bits of each 32-bit word, which is the selected channel of a
+ * 16-bit stereo frame once src has been offset to it.
+ */
+static void
+conv_s16x2_sse2(const uint8_t *src, int16_t *dst, uint32_t n, uint32_t stride)
+{
+	uint32_t i;
+
+	/* strictly less, the last frame of channel 1 ends 2 bytes short */
+	for (i = 0; i + 8 < n; i += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + i * 4));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + i * 4 + 16));
+
+		a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+		b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(a, b));
+	}
+	conv_s16(src + i * stride, dst + i, n - i, stride);
+}
+
+static void
+conv_s32_sse2(const uint8_t *src, int16_t *dst, uint32_t n, uint32_t stride)
+{
+	uint32_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + i * 4));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + i * 4 + 16));
+
+		a = _mm_srai_epi32(a, 16);
+		b = _mm_srai_epi32(b, 16);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(a, b));
+	}
+	conv_s32(src + i * stride, dst + i, n - i, stride);
+}
+
+/* Scale, floor (truncate then step down where that rounded up), saturate */
+static inline __m128i
+f32_floor_sse2(__m128 f)
+{
+	__m128i t = _mm_cvttps_epi32(f);
+
+	return(_mm_add_epi32(t, _mm_castps_si128(
+				     _mm_cmpgt_ps(_mm_cvtepi32_ps(t), f))));
+}
+
+static void
+conv_f32_sse2(const uint8_t *src, int16_t *dst, uint32_t n, uint32_t stride)
+{
+	const __m128 scale = _mm_set1_ps(32767.0f);
+	const __m128 lo = _mm_set1_ps(-32768.0f);
+	const __m128 hi = _mm_set1_ps(32767.0f);
+	uint32_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128 a = _mm_loadu_ps((const float *)(src + i * 4));
+		__m128 b = _mm_loadu_ps((const float *)(src + i * 4 + 16));
+
+		/* clamp first so the int conversion can't overflow */
+		a = _mm_min_ps(_mm_max_ps(_mm_mul_ps(a, scale), lo), hi);
+		b = _mm_min_ps(_mm_max_ps(_mm_mul_ps(b, scale), lo), hi);
+		_mm_storeu_si128((__m128i *)(dst + i),
+				 _mm_packs_epi32(f32_floor_sse2(a),
+						 f32_floor_sse2(b)));
+	}
+	conv_f32(src + i * stride, dst + i, n - i, stride);
+}
+
+__attribute__((target("avx2"))) static void
+conv_u8_avx2(const uint8_t *src, int16_t *dst, uint32_t n, uint32_t stride)
+{
+	const __m256i bias = _mm256_set1_epi16(128);
+	uint32_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m256i w = _mm256_cvtepu8_epi16(
+			_mm_loadu_si128((const __m128i *)(src + i)));
+
+		w = _mm256_slli_epi16(_mm256_sub_epi16(w, bias), 8);
+		_mm256_storeu_si256((__m256i *)(dst + i), w);
+	}
+	conv_u8(src + i, dst + i, n - i, stride);
+}
+
+__attribute__((target("avx2"))) static void
+conv_s16x2_avx2(const uint8_t *src, int16_t *dst, uint32_t n, uint32_t stride)
+{
+	uint32_t i;
+
+	for (i = 0; i + 16 < n; i += 16) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + i * 4 + 32));
+
+		a = _mm256_srai_epi32(_mm256_slli_epi32(a, 16), 16);
+		b = _mm256_srai_epi32(_mm256_slli_epi32(b, 16), 16);
+		_mm256_storeu_si256((__m256i *)(dst + i),
+				    _mm256_permute4x64_epi64(
+					    _mm256_packs_epi32(a, b),
+					    AVX2_PACK_ORDER));
+	}
+	conv_s16(src + i * stride, dst + i, n - i, stride);
+}
+
+__attribute__((target("avx2"))) static void
+conv_s24_avx2(const uint8_t *src, int16_t *dst, uint32_t n, uint32_t stride)
+{
+	/* Top two bytes of each of the 4 samples in a lane's 12 bytes */
+	const __m256i pick = _mm256_setr_epi8(
+		1, 2, 4, 5, 7, 8, 10, 11, -1, -1, -1, -1, -1, -1, -1, -1,
+		1, 2, 4, 5, 7, 8, 10, 11, -1, -1, -1, -1, -1, -1, -1, -1);
+	uint32_t i;
+
+	/* Each lane loads 16 bytes for 12, stay 2 samples clear of the end */
+	for (i = 0; i + 10 <= n; i += 8) {
+		__m256i v = _mm256_loadu2_m128i(
+			(const __m128i *)(src + i * 3 + 12),
+			(const __m128i *)(src + i * 3));
+
+		v = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(v, pick),
+					     AVX2_PACK_ORDER);
+		_mm_storeu_si128((__m128i *)(dst + i),
+				 _mm256_castsi256_si128(v));
+	}
+	conv_s24(src + i * stride, dst + i, n - i, stride);
+}
+
+__attribute__((target("avx2"))) static void
+conv_s32_avx2(const uint8_t *src, int16_t *dst, uint32_t n, uint32_t stride)
+{
+	uint32_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + i * 4 + 32));
+
+		a = _mm256_srai_epi32(a, 16);
+		b = _mm256_srai_epi32(b, 16);
+		_mm256_storeu_si256((__m256i *)(dst + i),
+				    _mm256_permute4x64_epi64(
+					    _mm256_packs_epi32(a, b),
+					    AVX2_PACK_ORDER));
+	}
+	conv_s32(src + i * stride, dst + i, n - i, stride);
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+f32_floor_avx2(__m256 f)
+{
+	return(_mm256_cvtps_epi32(_mm256_floor_ps(f)));
+}
+
+__attribute__((target("avx2"))) static void
+conv_f32_avx2(const uint8_t *src, int16_t *dst, uint32_t n, uint32_t stride)
+{
+	const __m256 scale = _mm256_set1_ps(32767.0f);
+	const __m256 lo = _mm256_set1_ps(-32768.0f);
+	const __m256 hi = _mm256_set1_ps(32767.0f);
+	uint32_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m256 a = _mm256_loadu_ps((const float *)(src + i * 4));
+		__m256 b = _mm256_loadu_ps((const float *)(src + i * 4 + 32));
+
+		a = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(a, scale), lo), hi);
+		b = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(b, scale), lo), hi);
+		_mm256_storeu_si256((__m256i *)(dst + i),
+				    _mm256_permute4x64_epi64(
+					    _mm256_packs_epi32(f32_floor_avx2(a),
+							       f32_floor_avx2(b)),
+					    AVX2_PACK_ORDER));
+	}
+	conv_f32(src + i * stride, dst + i, n - i, stride);
+}
+#endif /* HAVE_X86_SIMD */
+
+/*
+ * Sets sound->conv for the format, NULL for 16-bit mono which needs no
+ * conversion. Returns false for formats that can't be handled.
+ */
+static bool
+wav_pick_conv(sound_t *sound, uint16_t format_type)
+{
+	bool mono = (sound->channels == 1);
+	bool avx2 = cocotape_has_avx2();
+
+	(void)avx2;
+	sound->conv = NULL;
+
+	if (format_type == WAVE_FORMAT_IEEE_FLOAT) {
+		if (sound->bits_per_sample != 32)
+			return(false);
+		sound->conv = conv_f32;
+#ifdef HAVE_X86_SIMD
+		if (mono)
+			sound->conv = avx2 ? conv_f32_avx2 : conv_f32_sse2;
+#endif
+		return(true);
+	}
+
+	switch (sound->bits_per_sample) {
+	case 8:
+		sound->conv = conv_u8;
+#ifdef HAVE_X86_SIMD
+		if (mono)
+			sound->conv = avx2 ? conv_u8_avx2 : conv_u8_sse2;
+#endif
+		break;
+
+	case 16:
+		if (mono)
+			break;
+		sound->conv = conv_s16;
+#ifdef HAVE_X86_SIMD
+		if (sound->channels == 2)
+			sound->conv = avx2 ? conv_s16x2_avx2 : conv_s16x2_sse2;
+#endif
+		break;
+
+	case 24:
+		sound->conv = conv_s24;
+#ifdef HAVE_X86_SIMD
+		if (mono && avx2)
+			sound->conv = conv_s24_avx2;
+#endif
+		break;
+
+	case 32:
+		sound->conv = conv_s32;
+#ifdef HAVE_X86_SIMD
+		if (mono)
+			sound->conv = avx2 ? conv_s32_avx2 : conv_s32_sse2;
+#endif
+		break;
+
+	default:
+		return(false);
+	}
+
+	return(true);
+}
+
+/*
+ * Pulls the next len header bytes from either the mapping or the
+ * stream. Returns false if the source runs dry first.
+ */
+static bool
+wav_get(sound_t *sound, void *buf, size_t len)
+{
+	if (sound->file)
+		return(fread(buf, 1, len, sound->file) == len);
+
+	if (len > ((uint8_t *)sound->map + sound->maplen) - sound->pos)
+		return(false);
+	memcpy(buf, sound->pos, len);
+	sound->pos += len;
+	return(true);
+}
+
+/*
+ * Moves past len bytes of a chunk the decoder has no use for. In the
+ * mapping that is just moving the position, a seekable stream seeks,
+ * only a pipe has to actually read through them.
+ */
+static bool
+wav_skip(sound_t *sound, uint32_t len)
+{
+	uint8_t	tmp[4096];
+	size_t	n;
+
+	if (!sound->file) {
+		if (len > ((uint8_t *)sound->map + sound->maplen) - sound->pos)
+			return(false);
+		sound->pos += len;
+		return(true);
+	}
+
+	if (fseek(sound->file, len, SEEK_CUR) == 0)
+		return(true);
+
+	while (len) {
+		n = (len < sizeof(tmp)) ? len : sizeof(tmp);
+		if (fread(tmp, 1, n, sound->file) != n)
+			return(false);
+		len -= n;
+	}
+	return(true);
+}
+
+/* 
+ * Loads 8, 16, 24 and 32-bit integer and 32-bit float PCM .WAV files
+ * with any number of channels. 
+ * Maps the file read-only and points sound->raw at the pcm data inside
+ * the mapping. For 16-bit 1-channel files sound->data points there too
+ * and nothing is ever copied, anything else is converted a chunk at a
+ * time by wav_window(). A filename of "-" reads stdin instead, and the
+ * pcm data is pulled, converted, with wav_read().
+ * Fills sound->samples with the number of frames, each becomes one
+ * 16-bit sample of the selected channel.
+ *
+ * The RIFF chunks are walked in whatever order they come, anything
+ * other than "fmt " and "data" (LIST, fact, bext, JUNK, ...) is skipped
+ * using its declared size without being read.
+ */
+bool load_wav(const char *filename, sound_t *sound) {
+	int fd;
+	struct stat st;
+	char magic[4];
+	uint32_t filesize;
+	struct wav_chunk ck;
+	struct wav_fmt fmt;
+	bool have_fmt = false;
+	uint32_t len;
+	uint32_t data_size;	/* RIFF sizes are unsigned */
+
+	memset(sound, 0, sizeof(sound_t));
+
+	if (!strcmp(filename, "-")) {
+		sound->file = stdin;
+		goto READ_HEADER;
+	}
+
+	fd = open(filename, O_RDONLY);
+	if(fd < 0) {
+		PRINT_ERROR("%s: Failed to open file", filename);
+		return false;
+	}
+
+	if(fstat(fd, &st) < 0 || st.st_size == 0) {
+		PRINT_ERROR("%s: Failed to stat file", filename);
+		close(fd);
+		return false;
+	}
+
+	sound->maplen = st.st_size;
+	sound->map = mmap(NULL, sound->maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(sound->map == MAP_FAILED) {
+		PRINT_ERROR("%s: Failed to map %zu bytes", filename, sound->maplen);
+		sound->map = NULL;
+		return false;
+	}
+
+	/* The decode loop walks the data once front to back */
+	madvise(sound->map, sound->maplen, MADV_SEQUENTIAL);
+	sound->pos = sound->map;
+
+	READ_HEADER:
+#define WAV_GET(v, l) do {						\
+		if (!wav_get(sound, &(v), (l))) {			\
+			PRINT_ERROR("%s: Short WAV header", filename);	\
+			goto UNMAP_FILE;				\
+		}							\
+	} while (0)
+
+	WAV_GET(magic, 4);
+	if(magic[0] != 'R' || magic[1] != 'I' || magic[2] != 'F' || magic[3] != 'F') {
+		PRINT_ERROR("%s First 4 bytes should be \"RIFF\", are \"%4s\"", filename, magic);
+		goto UNMAP_FILE;
+	}
+
+	WAV_GET(filesize, 4);
+
+	WAV_GET(magic, 4);
+	if(magic[0] != 'W' || magic[1] != 'A' || magic[2] != 'V' || magic[3] != 'E') {
+		PRINT_ERROR("%s 4 bytes should be \"WAVE\", are \"%4s\"", filename, magic);
+		goto UNMAP_FILE;
+	}
+
+	/* Walk the chunks until data turns up */
+	while (1) {
+		WAV_GET(ck, sizeof(ck));
+
+		if (!memcmp(ck.id, "data", 4))
+			break;
+
+		/* Chunk bodies are padded out to an even length */
+		len = ck.size + (ck.size & 1);
+
+		if (!memcmp(ck.id, "fmt ", 4)) {
+			if (ck.size < WAV_FMT_PCMLEN) {
+				PRINT_ERROR("%s fmt chunk too short %u", filename,
+					    ck.size);
+				goto UNMAP_FILE;
+			}
+
+			memset(&fmt, 0, sizeof(fmt));
+			if (ck.size < sizeof(fmt)) {
+				WAV_GET(fmt, ck.size);
+			} else {
+				WAV_GET(fmt, sizeof(fmt));
+			}
+			len -= (ck.size < sizeof(fmt)) ? ck.size : sizeof(fmt);
+			have_fmt = true;
+		} else if (v_verbose) {
+			printf("Skipping %.4s chunk (%u bytes)\n", ck.id, ck.size);
+		}
+
+		if (!wav_skip(sound, len)) {
+			PRINT_ERROR("%s %.4s chunk runs past end of file",
+				    filename, ck.id);
+			goto UNMAP_FILE;
+		}
+	}
+#undef WAV_GET
+
+	if (!have_fmt) {
+		PRINT_ERROR("%s No \"fmt \" chunk before \"data\"", filename);
+		goto UNMAP_FILE;
+	}
+
+	/* Extensible carries the real format in the first 2 bytes of the GUID */
+	if (fmt.format_type == WAVE_FORMAT_EXTENSIBLE) {
+		if (fmt.cb_size < 22) {
+			PRINT_ERROR("%s extensible fmt too short %d", filename,
+				    fmt.cb_size);
+			goto UNMAP_FILE;
+		}
+		memcpy(&fmt.format_type, fmt.sub_format, 2);
+	}
+
+	if(fmt.format_type != WAVE_FORMAT_PCM &&
+	   fmt.format_type != WAVE_FORMAT_IEEE_FLOAT) {
+		PRINT_ERROR("%s format type should be 1 or 3, is %d", filename, fmt.format_type);
+		goto UNMAP_FILE;
+	}
+
+	if(fmt.num_channels < 1 || c_channel >= fmt.num_channels) {
+		PRINT_ERROR("%s Channel %d requested, file has %d", filename, c_channel, fmt.num_channels);
+		goto UNMAP_FILE;
+	}
+
+	if(fmt.sample_rate < MIN_RATE) {
+		PRINT_ERROR("%s Sample rate should be at least %d, is %d", filename, MIN_RATE, fmt.sample_rate);
+		goto UNMAP_FILE;
+	}
+
+	if(fmt.block_align != fmt.num_channels * (fmt.bits_per_sample / 8)) {
+		PRINT_ERROR("%s block align should be %d, is %d", filename,
+			    fmt.num_channels * (fmt.bits_per_sample / 8), fmt.block_align);
+		goto UNMAP_FILE;
+	}
+
+	sound->sample_rate = fmt.sample_rate;
+	sound->channels = fmt.num_channels;
+	sound->bits_per_sample = fmt.bits_per_sample;
+	sound->block_align = fmt.block_align;
+	sound->channel = c_channel;
+	if (!wav_pick_conv(sound, fmt.format_type)) {
+		PRINT_ERROR("%s %d-bit %s samples not supported", filename,
+			    fmt.bits_per_sample,
+			    (fmt.format_type == WAVE_FORMAT_PCM)?"integer":"float");
+		goto UNMAP_FILE;
+	}
+
+	if (v_verbose)
+		printf("Format:   %d-bit %s, %d channel(s), %d Hz\n",
+		       fmt.bits_per_sample,
+		       (fmt.format_type == WAVE_FORMAT_PCM)?"integer":"float",
+		       fmt.num_channels, fmt.sample_rate);
+
+	data_size = ck.size;
+
+	if (sound->file) {
+		/*
+		 * Capture tools writing to a pipe can't go back and fill
+		 * in the size, they leave 0 or -1. Read to EOF then.
+		 */
+		if (!data_size || (data_size == UINT32_MAX)) {
+			sound->remaining = UINT64_MAX;
+			data_size = 0;
+		} else
+			sound->remaining = data_size;
+		sound->samples = data_size / sound->block_align;
+
+		if (sound->conv) {
+			sound->stage = malloc(WAV_CHUNK_SAMPLES * sound->block_align);
+			if (!sound->stage) {
+				PRINT_ERROR("%s Failed to allocate stage buffer", filename);
+				goto UNMAP_FILE;
+			}
 		}
+		return true;
+	}
+
+	/* A truncated capture still decodes up to where it stops */
+	if(data_size > (size_t)(((uint8_t *)sound->map + sound->maplen) -
+				sound->pos)) {
+		PRINT_ERROR("%s data size %u runs past end of file, truncating",
+			    filename, data_size);
+		data_size = ((uint8_t *)sound->map + sound->maplen) - sound->pos;
 	}
 
-	if (repeat)
-		printf("Line repeated %ld time(s)\n", repeat);
+	sound->raw = sound->pos;
+	if (!sound->conv)
+		sound->data = (int16_t *)sound->raw;
+	sound->samples = data_size / sound->block_align;
+
+	return true;
+
+	UNMAP_FILE:
+	unload_wav(sound);
+
+	return false;
 }
 
+/*
+ * Reads up to n samples of a streamed data chunk into buf, returns
+ * how many were read, 0 at the end of the data.
+ */
+uint32_t
+wav_read(sound_t *sound, int16_t *buf, uint32_t n)
+{
+	size_t got;
 
+	if (n > WAV_CHUNK_SAMPLES)
+		n = WAV_CHUNK_SAMPLES;
+	if (n > sound->remaining / sound->block_align)
+		n = sound->remaining / sound->block_align;
+
+	if (!sound->conv) {
+		got = fread(buf, sizeof(int16_t), n, sound->file);
+	} else {
+		got = fread(sound->stage, sound->block_align, n, sound->file);
+		sound->conv(sound->stage + wav_chan_offset(sound), buf, got,
+			    sound->block_align);
+	}
+	sound->remaining -= got * sound->block_align;
+
+	return(got);
+}
+
+/*
+ * Returns n 16-bit samples starting at frame sample of a mapped file.
+ * Straight out of the mapping when possible, otherwise converted into
+ * buf, which must hold n samples.
+ */
+const int16_t *
+wav_window(sound_t *sound, uint32_t sample, uint32_t n, int16_t *buf)
+{
+	if (!sound->conv)
+		return(sound->data + sample);
+
+	sound->conv(sound->raw + (size_t)sample * sound->block_align +
+		    wav_chan_offset(sound), buf, n, sound->block_align);
+	return(buf);
+}
+
+/*
+ * Page granular readahead for the mapped data. Asks for the window
+ * starting at sample to be faulted in ahead of the decode loop and lets
+ * go of whatever is more than a window behind it, back to sample from
+ * where this decode loop started.
+ */
+void
+wav_readahead(sound_t *sound, uint32_t from, uint32_t sample)
+{
+	uintptr_t pgmask = (uintptr_t)sysconf(_SC_PAGESIZE) - 1;
+	uint8_t *base = sound->map;
+	uint8_t *end = base + sound->maplen;
+	uint8_t *ra;
+
+	ra = (uint8_t *)((uintptr_t)(sound->raw +
+				     (size_t)sample * sound->block_align) & ~pgmask);
+	if (ra >= end)
+		return;
+
+	madvise(ra, ((end - ra) < WAV_READAHEAD) ? (end - ra) : WAV_READAHEAD,
+		MADV_WILLNEED);
+
+	if (from)
+		base = (uint8_t *)((uintptr_t)(sound->raw +
+				(size_t)from * sound->block_align) & ~pgmask);
+	if (ra - base > WAV_READAHEAD)
+		madvise(base, (ra - WAV_READAHEAD) - base, MADV_DONTNEED);
+}
+
+void
+unload_wav(sound_t *sound)
+{
+	if (sound->map)
+		munmap(sound->map, sound->maplen);
+	free(sound->stage);
+	memset(sound, 0, sizeof(sound_t));
+}
+
+
+/*
+ * PERIOD FILES
+ * Saving pass one's output lets a bad tape be decoded over and over 
+ * with different period windows without touching the WAV again, the 
+ * periods being a fraction of its size.
+ */
+
+/* True if filename looks like a period file rather than a WAV */
+bool
+periods_probe(const char *filename)
+{
+	char	magic[sizeof(PERIOD_MAGIC) - 1];
+	FILE	*file;
+	bool	rc = false;
+
+	if (!strcmp(filename, "-"))
+		return(false);
+
+	if (!(file = fopen(filename, "rb")))
+		return(false);
+	if (fread(magic, 1, sizeof(magic), file) == sizeof(magic))
+		rc = !memcmp(magic, PERIOD_MAGIC, sizeof(magic));
+	fclose(file);
+
+	return(rc);
+}
+
+/* Maps a period file, pa->p points into the mapping */
+bool
+periods_load(const char *filename, struct periods *pa)
+{
+	struct period_hdr hdr;
+	struct stat	st;
+	int		fd;
+
+	memset(pa, 0, sizeof(struct periods));
+
+	fd = open(filename, O_RDONLY);
+	if(fd < 0) {
+		PRINT_ERROR("%s: Failed to open file", filename);
+		return false;
+	}
+
+	if(fstat(fd, &st) < 0 || st.st_size < sizeof(hdr)) {
+		PRINT_ERROR("%s: Too short for a period file", filename);
+		close(fd);
+		return false;
+	}
+
+	pa->maplen = st.st_size;
+	pa->map = mmap(NULL, pa->maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(pa->map == MAP_FAILED) {
+		PRINT_ERROR("%s: Failed to map %zu bytes", filename, pa->maplen);
+		pa->map = NULL;
+		return false;
+	}
+
+	memcpy(&hdr, pa->map, sizeof(hdr));
+	if (hdr.ph_n > (pa->maplen - sizeof(hdr)) / sizeof(uint16_t) ||
+	    hdr.ph_n > UINT32_MAX || hdr.ph_sample_rate < MIN_RATE) {
+		PRINT_ERROR("%s: Bad period file header", filename);
+		periods_free(pa);
+		return false;
+	}
+
+	pa->p = (uint16_t *)((uint8_t *)pa->map + sizeof(hdr));
+	pa->n = hdr.ph_n;
+	pa->sample_rate = hdr.ph_sample_rate;
+
+	return true;
+}
+
+bool
+periods_save(const char *filename, const struct periods *pa)
+{
+	struct period_hdr hdr;
+	FILE	*file;
+	bool	rc;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.ph_magic, PERIOD_MAGIC, sizeof(hdr.ph_magic));
+	hdr.ph_sample_rate = pa->sample_rate;
+	hdr.ph_n = pa->n;
+
+	if (!(file = fopen(filename, "wb"))) {
+		PRINT_ERROR("%s: Failed to create file", filename);
+		return false;
+	}
+
+	rc = (fwrite(&hdr, sizeof(hdr), 1, file) == 1) &&
+		(fwrite(pa->p, sizeof(uint16_t), pa->n, file) == pa->n);
+	if (fclose(file) || !rc) {
+		PRINT_ERROR("%s: Failed to write periods", filename);
+		return false;
+	}
+
+	return true;
+}
+
+/* Only a mapped period file is ours, kept periods go with their decoder */
+void
+periods_free(struct periods *pa)
+{
+	if (pa->map)
+		munmap(pa->map, pa->maplen);
+	memset(pa, 0, sizeof(struct periods));
+}
+
+
+/*
+ * TAPE INDEX
+ * Where every block is on a recording, so a program can be decoded 
+ * without going through everything before it. NAME.idx for NAME.wav,
+ * holding the sample count and rate of the WAV to catch a stale one.
+ */
+
+/* NAME.idx for dir/NAME.wav, or NAME with .idx added */
+static bool
+index_path(const char *wavname, char *path, size_t len)
+{
+	const char	*base, *dot;
+	int		n;
+
+	base = strrchr(wavname, '/');
+	base = base ? base + 1 : wavname;
+	dot = strrchr(base, '.');
+	n = dot ? dot - wavname : (int)strlen(wavname);
+	if (snprintf(path, len, "%.*s.idx", n, wavname) >= len) {
+		fprintf(stderr, "**** %s: Index name too long\n", wavname);
+		return false;
+	}
+	return true;
+}
+
+/* An empty index for a decode of wav */
+void
+index_init(struct tape_index *ti, const sound_t *wav)
+{
+	memset(ti, 0, sizeof(struct tape_index));
+	ti->sample_rate = wav->sample_rate;
+	ti->samples = wav->samples;
+}
+
+/* Notes a block, a cocotape_block_fn with a struct tape_index */
+void
+index_block(void *arg, const struct block *b)
+{
+	struct tape_index *ti = arg;
+	struct index_rec *r;
+	uint32_t	cap;
+
+	if (ti->n == ti->cap) {
+		cap = ti->cap ? ti->cap * 2 : 256;
+		if (!(r = realloc(ti->r, cap * sizeof(struct index_rec)))) {
+			ti->err = true;
+			return;
+		}
+		ti->r = r;
+		ti->cap = cap;
+	}
+
+	r = &ti->r[ti->n++];
+	memset(r, 0, sizeof(struct index_rec));
+	r->ir_start = b->b_start;
+	r->ir_end = b->b_end;
+	r->ir_num = b->b_num;
+	r->ir_prog = b->b_prog;
+	r->ir_type = b->b_type;
+	r->ir_length = b->b_length;
+	r->ir_bad = b->b_bad;
+}
+
+bool
+index_save(const char *wavname, struct tape_index *ti)
+{
+	struct index_hdr hdr;
+	char		path[PATH_MAX];
+	FILE		*file;
+	bool		rc;
+
+	if (ti->err) {
+		PRINT_ERROR("%s: Failed to malloc the index", wavname);
+		return false;
+	}
+	if (!index_path(wavname, path, sizeof(path)))
+		return false;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.ih_magic, INDEX_MAGIC, sizeof(hdr.ih_magic));
+	hdr.ih_sample_rate = ti->sample_rate;
+	hdr.ih_samples = ti->samples;
+	hdr.ih_n = ti->n;
+
+	if (!(file = fopen(path, "wb"))) {
+		PRINT_ERROR("%s: Failed to create file", path);
+		return false;
+	}
+
+	rc = (fwrite(&hdr, sizeof(hdr), 1, file) == 1) &&
+		(fwrite(ti->r, sizeof(struct index_rec), ti->n, file) == ti->n);
+	if (fclose(file) || !rc) {
+		PRINT_ERROR("%s: Failed to write the index", path);
+		return false;
+	}
+
+	return true;
+}
+
+bool
+index_load(const char *wavname, struct tape_index *ti)
+{
+	struct index_hdr hdr;
+	struct stat	st;
+	char		path[PATH_MAX];
+	int		fd;
+
+	memset(ti, 0, sizeof(struct tape_index));
+	if (!index_path(wavname, path, sizeof(path)))
+		return false;
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		PRINT_ERROR("%s: Failed to open file, decode with -X first",
+			    path);
+		return false;
+	}
+
+	if(fstat(fd, &st) < 0 || st.st_size < sizeof(hdr)) {
+		PRINT_ERROR("%s: Too short for an index", path);
+		close(fd);
+		return false;
+	}
+
+	ti->maplen = st.st_size;
+	ti->map = mmap(NULL, ti->maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(ti->map == MAP_FAILED) {
+		PRINT_ERROR("%s: Failed to map %zu bytes", path, ti->maplen);
+		ti->map = NULL;
+		return false;
+	}
+
+	memcpy(&hdr, ti->map, sizeof(hdr));
+	if (memcmp(hdr.ih_magic, INDEX_MAGIC, sizeof(hdr.ih_magic)) ||
+	    hdr.ih_n > (ti->maplen - sizeof(hdr)) / sizeof(struct index_rec)) {
+		PRINT_ERROR("%s: Bad index header", path);
+		index_free(ti);
+		return false;
+	}
+
+	ti->r = (struct index_rec *)((uint8_t *)ti->map + sizeof(hdr));
+	ti->n = hdr.ih_n;
+	ti->sample_rate = hdr.ih_sample_rate;
+	ti->samples = hdr.ih_samples;
+
+	return true;
+}
+
+void
+index_free(struct tape_index *ti)
+{
+	if (ti->map)
+		munmap(ti->map, ti->maplen);
+	else
+		free(ti->r);
+	memset(ti, 0, sizeof(struct tape_index));
+}
+
+/*
+ * Decodes program prog of filename from its index, the samples between
+ * the end of the block before it and the end of its last block.
+ */
+int
+index_decode(const struct cocotape_config *cfg, const char *filename,
+	     int32_t prog)
+{
+	struct cocotape_config pcfg = *cfg;
+	struct tape_index ti;
+	struct cocotape	*ctx = NULL;
+	sound_t		wav;
+	uint64_t	start = 0, end = 0;
+	uint32_t	i;
+	int		rc = -1;
+	static int16_t	chunk[WAV_CHUNK_SAMPLES];
+
+	if (!index_load(filename, &ti))
+		return(-1);
+	if (!load_wav(filename, &wav)) {
+		PRINT_ERROR("Failed to load .wav");
+		index_free(&ti);
+		return(-1);
+	}
+	if ((ti.samples != wav.samples) ||
+	    (ti.sample_rate != wav.sample_rate)) {
+		fprintf(stderr, "**** %s: Index is not for this WAV, decode "
+			"with -X again\n", filename);
+		goto out;
+	}
+
+	for (i = 0; (i < ti.n) && (ti.r[i].ir_prog != prog); i++)
+		start = ti.r[i].ir_end;
+	if (i == ti.n) {
+		fprintf(stderr, "**** %s: No program %d, the tape has %d\n",
+			filename, prog, ti.n ? ti.r[ti.n - 1].ir_prog : 0);
+		goto out;
+	}
+	for (; (i < ti.n) && (ti.r[i].ir_prog == prog); i++)
+		end = ti.r[i].ir_end;
+	if (end > wav.samples)
+		end = wav.samples;
+
+	pcfg.sample_rate = wav.sample_rate;
+	pcfg.keep = false;
+	if (!(ctx = cocotape_new(&pcfg)) ||
+	    decode_wav(&wav, ctx, start, end, chunk))
+		goto out;
+	rc = cocotape_finish(ctx);
+
+out:
+	cocotape_free(ctx);
+	unload_wav(&wav);
+	index_free(&ti);
+	return(rc);
+}
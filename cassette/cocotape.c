@@ -0,0 +1,2167 @@
+/*
+ * Copyright (c) 2023, Philip Kufeldt
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * libcocotape, the decoder behind coco_tape, see cocotape.h for how it
+ * is used.
+ *
+ * ENCODING INFORMATION 
+ * The cassette format chosen uses a sinewave of 2400 or 1200 Hertz 
+ * to yield a Baud rate of approximately 1500 Baud. In this format, 
+ * a 0 (or logic low) is represented by one cycle of 1200 Hertz, and 
+ * a 1 (or logic high) is represented by one cycle of 2400 Hertz. A 
+ * typical program tape would consist of a leader of alternating 1's 
+ * and O's, followed by one or more blocks of data. A block of data 
+ * is composed of 0 to 255 bytes of data with a checksum, sync byte, 
+ * and the block length. 
+ * 
+ * DETAILED TAPE FORMAT INFORMATION 
+ * The standard TRS-80 Color Computer tape is composed of the following 
+ * items: 
+ *	1. A leader consisting of 128 bytes of Hex 55 
+ *	2. A Namefile block 
+ *	3. A blank section of tape approximately equal to 0.5 seconds 
+ * 	   in length; this allows BASIC time to evaluate the Namefile. 
+ *	4. A second leader of 128 bytes of Hex 55 
+ *	5. One or more Data blocks 
+ *	6. An End of File block 
+ *
+ * The block format for Data blocks, Namefile blocks, or an End of File 
+ * block is as follows: 
+ *	1. One leader byte — 
+ * 		55H = Leader byte
+ *	2. One sync byte — 
+ *		3CH = Sync byte
+ *	3. One block type byte — 
+ *		00H = Namefile 
+ *		01H = Data 
+ *		FFH = End of File 
+ *	4. One block length byte — 
+ *		00H to FFH 
+ *	5. Data — 0 to 255 bytes 
+ *	6. One checksum byte — 
+ *		the sum of all the data plus block type and block length 
+ *	7. One leader byte — 
+ * 		55H = Leader byte
+ *
+ * The End of File block is a standard block with a length of 0 and 
+ * the block type equal to FFH. 
+ *
+ * The Namefile block is a standard block with a length of 15 bytes (0FH) 
+ * and the block type equals 00H. The 15 bytes of data provide information 
+ * to BASIC and are employed as described below: 
+ *	1. Eight bytes for the program name 
+ *	2. One file type byte — 
+ *		00H = BASIC 
+ *		01H = Data 
+ *		02H = Machine Language 
+ *	3. One ASCII flag byte — 
+ *		00H = Binary 
+ *		FFH = ASCII 
+ *	4. One Gap flag byte — 
+ *		01H = Continuous 
+ *		FFH = Gaps 
+ *	5. Two bytes for the start address of a machine language program 
+ *	6. Two bytes for the load address of a machine language program 
+ * 
+ * BASIC DATA BLOCK FORMAT
+ * A BASIC data block is a byte array with up to 255 bytes. Laid end to
+ * end the data blocks are the program as it was in RAM, see 
+ * prog_image(). It is line oriented, each line null terminated and 
+ * pointing at the next. Lines contain some metadata and are encoded 
+ * with CoCo BASIC tokens.
+ *
+ * LINE FORMAT
+ *	Offset:		Type:	Value:
+ *	0:1		word	RAM address of the next line, 0 after the last
+ *	2:3		word	BASIC Program line number
+ *	4-		byte[]	Encoded BASIC Program line, null terminated
+ *
+ * NEXT LINE ADDRESS
+ * The next line address is where the next line was in RAM, so it is
+ * relative to the address the program was loaded at, its load base.
+ * That depends on the machine, 0x0601 for Color BASIC, 0x1E01 for 
+ * Extended BASIC and 0x2601 for Disk BASIC, and on PCLEAR, so it is 
+ * worked out from the first line: its next line address less where 
+ * the byte after its null is. From then on each line is a jump from
+ * the one before, see next_line(), without looking at what is in it.
+ * Listing lines n to m still walks from the first line, a jump each,
+ * but stops at the first one past m as long as the line numbers have
+ * been going up, see print_prog(). The rest of the program, and any
+ * line that would show it is cut short, is never looked at.
+ * An address not landing just after a null is not trusted, the line 
+ * runs up to its null, as the CoCo relinks a program it loads anyway.
+ *
+ * This used to be read as a data block number from 30 (0x1e) and an 
+ * offset in it off by one more byte per data block. That is the high
+ * byte of a 0x1E01 load base and 255 byte data blocks drifting against
+ * 256 byte pages, and it broke down once a line started a page behind
+ * its data block, about 8K into a program.
+ *
+ * DECODING INFORMATION
+ * This program takes a simple approach to decoding the data in the WAV file.
+ * Since bits are encoded as a sine wave with a freq of either a 1200Hz (0)
+ * or 2400Hz (1) AND since the WAV file format samples at a fixed rate of
+ * 44100Hz, the number of data data points per sine wave cycle can identify 
+ * the frequency. That is an encoded 1 will have 44100/2400=18.375 data 
+ * points per cycle and an encoded 0 will have 44100/1200=36.75 data 
+ * points per cycle. To find a cycle this code looks for a falling zero
+ * crossing in the WAV data then starts counting the data points until the 
+ * next falling zero crossing. 
+ *
+ * However, the CoCos 6 bit A/D converter made the accurancy of a 1200/2400
+ * fequency very suspect, plus the variability in recordings and noise, means 
+ * that the WAV data is not that precise, so data counts can not be fixed 
+ * numbers but rather ranges.
+ *
+ * During testing it was determined that a 1 (high) was defined by the range
+ * of 18-31, and a 0 (low) was 31-inf. These may prove to be slightly different
+ * on a per recording basis, so params are provided to define them at runtime.
+ *
+ * OTHER SAMPLE RATES
+ * The ranges above, and the runtime params, are data points at 44100Hz.
+ * For any other rate they are scaled by rate/44100 when the decoder is 
+ * set up, so a 22050Hz recording works with the very same numbers. To 
+ * keep that scaling from losing precision at low rates, periods are not
+ * whole data point counts but fixed point with PERIOD_FRAC_BITS of 
+ * fraction. Each falling zero crossing is placed between the last 
+ * non-negative and first negative sample by linear interpolation, and a
+ * period is the distance between two of them. As integer counts a 1 was
+ * 18 to 31 inclusive, so as fixed point it is [18, 32).
+ *
+ * CALIBRATION
+ * Rather than finding working ranges by trial and error autocal
+ * has the decoder measure them from the tape. Every leader is 128 bytes
+ * of 0x55, i.e. 1024 cycles alternating short (1) and long (0). While 
+ * waiting for a sync byte the decoder watches for a run of CAL_CYCLES
+ * periods that alternate with a long/short ratio of about 2. Those are
+ * put in a histogram and split into the two clusters with Otsu's method,
+ * the split between the cluster means becomes the 1/0 boundary and the
+ * low end of a 1 is set as far below the 1 mean as the boundary is 
+ * above it. The high end of a 0 stays as given. This happens again on
+ * every leader, well before its sync byte, so a tape made of several 
+ * recordings gets each calibrated separately.
+ *
+ * RECOVERY
+ * Normally the first block failing its checksum ends the decode. With
+ * recover set it is marked bad and reported, and the decoder goes 
+ * straight back to looking for a sync byte; a dropout may well have 
+ * shifted the bits, so it does not wait out a leader byte first. A 
+ * program with a bad block is not listed, the blocks that failed are,
+ * and decoding carries on with the next one.
+ *
+ * CATALOG
+ * With catalog set only Namefile and End of File blocks are read in 
+ * full. A Data block is done once its length is known, its data is
+ * not read and not checked. Every period is a bit, so the decoder 
+ * passes over the 8 periods of each data and checksum byte without
+ * classifying them and goes back to hunting for the next sync byte
+ * right where it is. Skipping by time instead, by how long the bits
+ * could be at their shortest, lands inside the data of any block that
+ * is not all 1s, and data such as a run of 0x55 then 0x3C is taken
+ * for another block. Each program is listed as one line, see 
+ * print_catalog().
+ *
+ * SELECTING
+ * With program set only the program of that name is listed. Every
+ * other program is read as a catalog reads it, its Data blocks 
+ * skipped, and so is one with no Namefile block. Once the End of File
+ * block of the one asked for is read the decoder is done, anything
+ * pushed after that is ignored and cocotape_done() says so, so the
+ * caller can stop reading the recording. cocotape_finish() fails if
+ * the program was never found.
+ *
+ * SAMPLE POSITIONS
+ * Every block carries where it was on the recording, b_start the first
+ * sample of the leader byte before its sync byte and b_end one past the
+ * crossing that ended its last bit, or where it would have if a gap 
+ * follows, counted from the first sample pushed. Pass two adds up the
+ * periods as it goes, pass one notes how long each period it saturated
+ * really was so silence costs nothing in precision. Periods pushed by
+ * the caller only have saturated values to go on, positions after a 
+ * gap are then short by whatever was cut off.
+ * The last HUNT_RING periods of the hunt for a sync byte are kept to 
+ * find where its leader byte started.
+ *
+ * LISTING OUTPUT
+ * A listing is built up in a struct obuf, every character, token and
+ * line number copied in as it is detokenized, and handed to stdio 
+ * OBUF_SIZE bytes at a time with one fwrite(), not a printf() each. A
+ * write that big goes straight through to the file. Anything else the
+ * listing code prints flushes the buffer first, so output stays in
+ * order.
+ *
+ * INCREMENTAL LISTING
+ * With incremental set a program is listed as it is read, not once its
+ * End of File block is. Its name goes out with its Namefile block, and
+ * each Data block passing its checksum is added to what is left of the
+ * image, STREAM_BUF bytes at most, every line it completes listed and
+ * flushed right away, see stream_block(). A listed Data block is not
+ * kept. A bad block stops the listing where it is, the blocks failing
+ * are reported at the end as usual. Not with on_prog or catalog.
+ *
+ * DECODE VARIANTS
+ * Both passes are written once as inline functions taking a constant
+ * instr flag and built twice, the production variant with every bit
+ * of debug output and its checks compiled out, and the instrumented 
+ * variant with them in. The decoder picks one when it is set up, debug
+ * or instr get the instrumented one.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "cocotape.h"
+#include "cocotape_simd.h"
+
+#ifdef __GNUC__
+#define ALWAYS_INLINE	inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE	inline
+#endif
+
+#define PRINT_ERROR(out, a, args...) do {				\
+	if (out)							\
+		fprintf(out, "ERROR %s() %s Line %d: " a "\n",		\
+			__FUNCTION__, __FILE__, __LINE__, ##args);	\
+} while (0)
+
+#define SYNCBYTE	0x3C
+#define LEADERBYTE	0x55
+
+#define BLOCKCAP	256	/* Blocks first made room for, 64K of BASIC */
+#define IMGCAP		(1 << 16)	/* Program image first made room for */
+
+/*
+ * State machine states for reading in data. Hunting for the sync byte
+ * goes a bit at a time, everything after it a byte at a time, see
+ * frame_byte().
+ */ 
+enum block_state {
+	BS_NEED_LEADBYTE,
+	BS_NEED_SYNCBYTE,
+	BS_NEED_BLOCKTYPE,
+	BS_NEED_LENGTH,
+	BS_NEED_DATA,
+	BS_NEED_CKSUM,
+	BS_DONE,
+};
+
+/*
+ * Block decoding state, everything touched per bit or byte and
+ * small enough to share a cache line with the period windows.
+ */
+struct framer {
+	enum block_state f_state;	/* State machine value for decoding */
+	enum blocktype	f_type;
+	uint8_t		f_length;
+	uint8_t		f_cksum;
+	uint8_t		f_byte;
+	uint8_t		f_nbit;
+	uint8_t		f_i;		/* Bytes so far in the current field */
+	bool		f_bad;		/* Failed its checksum */
+	struct block	*f_blk;		/* Block being filled, NULL for none */
+};
+
+#define PERIOD_ONE		(1 << PERIOD_FRAC_BITS)
+
+/* The rate the period ranges are specified at */
+#define REF_RATE		44100
+
+/* printf("%u.%02u") arguments for a fixed point period */
+#define PERIOD_FMT(p)	(unsigned)((p) >> PERIOD_FRAC_BITS), \
+		(unsigned)((((p) & (PERIOD_ONE - 1)) * 100) >> PERIOD_FRAC_BITS)
+
+/*
+ * Falling zero crossing finder, see ZERO CROSSING KERNELS below. 
+ * Writes the index of each crossing in data to pos, returns how many.
+ */
+typedef uint32_t (*xing_fn_t)(const int16_t *data, uint32_t n, int16_t prev,
+			      uint32_t *pos);
+
+/* Samples scanned per kernel call, pos must hold XING_BLOCK/2 + 1 */
+#define XING_BLOCK	4096
+
+/* Samples pass one takes at a time, bigger pushes are split up */
+#define SCAN_CHUNK	(1 << 16)
+
+/* Listing bytes written at a time, see LISTING OUTPUT */
+#define OBUF_SIZE	(1 << 14)
+
+/* Data blocks are skipped, not read, see CATALOG and SELECTING */
+#define SKIP_DATA(dec)	((dec)->catalog || (dec)->passing)
+
+/*
+ * Cycle periods, pass one's output and pass two's input. One fixed
+ * point period per falling crossing, anything longer than PERIOD_MAX
+ * (silence) is saturated to it.
+ */
+struct period_buf {
+	uint16_t	*p;
+	uint32_t	n, cap;
+};
+
+/* A period pass one saturated, its index in pa and real length */
+struct sat {
+	uint32_t	s_i;
+	uint64_t	s_period;
+};
+
+/* Pass one state, carried from one chunk of samples to the next */
+struct scanner {
+	uint64_t	sample;		/* Index of the next sample */
+	uint64_t	cross;		/* Last falling crossing, fixed point */
+	int16_t		prev;		/* Last sample seen */
+	bool		primed;		/* prev is valid */
+
+	/* This chunk's saturated periods, see SAMPLE POSITIONS */
+	struct sat	*sat;
+	uint32_t	nsat, satcap;
+
+	xing_fn_t	find_xings;
+	uint32_t	xpos[XING_BLOCK/2 + 1];	/* Crossings in a block */
+
+	/* Debug only, chunk index of the crossing ending each period */
+	uint32_t	*at;
+};
+
+/* Leader cycles measured to calibrate, 32 bytes worth of the 128 */
+#define CAL_CYCLES	256
+
+/* Long/short ratio of adjacent leader periods, in tenths */
+#define CAL_RATIO_LO	14
+#define CAL_RATIO_HI	28
+
+/* Sync hunt periods kept, the leader and sync bytes */
+#define HUNT_RING	16
+
+/* Histogram bin width, fixed point bits dropped, and bin count */
+#define CAL_BIN_SHIFT	2
+#define CAL_BINS	1024
+
+/* A line of a program image, see LINE FORMAT */
+struct prog_line {
+	uint32_t	pl_off;		/* Of its tokens */
+	uint16_t	pl_len;		/* Of its tokens, up to the null */
+	uint16_t	pl_num;
+};
+
+/* Room for a program's image, grown for a longer one, never shrunk */
+struct prog_img {
+	uint8_t		*pi_buf;
+	size_t		pi_cap;
+};
+
+/* Following the lines of a program image, see NEXT LINE ADDRESS */
+struct linker {
+	size_t		lk_pos;		/* Where the next line starts */
+	uint16_t	lk_base;	/* RAM address of the image */
+	bool		lk_based;	/* lk_base is known */
+	uint32_t	lk_relinked;	/* Lines whose address was off */
+};
+
+/* A program listed as it is read, see INCREMENTAL LISTING */
+#define STREAM_BUF	1024	/* The longest line and a block, and then some */
+struct stream {
+	bool		s_on;		/* Started on a program */
+	bool		s_stop;		/* Past its last line, or a bad block */
+	bool		s_unsorted;	/* Line numbers not always going up */
+	uint32_t	s_nline;	/* Lines gone by */
+	uint16_t	s_num;		/* The last one's number */
+	size_t		s_n;		/* Of the image left in s_buf */
+	size_t		s_drop;		/* Of it listed and dropped before that */
+	struct linker	s_lk;
+	uint8_t		s_buf[STREAM_BUF];
+};
+
+/* A decoder, all its state carried from one push to the next */
+struct cocotape {
+	/* Period windows at the recording's rate, fixed point, [lo, hi) */
+	uint32_t	one_lo, one_hi;
+	uint32_t	zero_lo, zero_hi;
+
+	struct framer	fr;
+
+	/* Leader calibration, see CALIBRATION above */
+	bool		cal;		/* Calibrate at every leader */
+	bool		cal_done;	/* Calibrated on the current leader */
+	bool		cal_up;		/* Last step was short to long */
+	uint16_t	cal_last;	/* Last period */
+	uint32_t	cal_run;	/* Alternating periods in a row */
+	uint16_t	cal_ring[CAL_CYCLES];
+
+	/* Debug only, the chunk the periods came from, see scanner.at */
+	const int16_t	*dbg_data;
+	uint32_t	dbg_n;
+	const uint32_t	*dbg_at;
+
+	/* Pass two variant, see DECODE VARIANTS */
+	int		(*run)(struct cocotape *dec, const uint16_t *p,
+			       uint32_t n);
+
+	/* Output, none at all for a quiet decoder, one without out */
+	bool		quiet;
+	bool		debug;
+	bool		verbose;
+
+	/* Data blocks not read, periods, bits, still to skip */
+	bool		catalog;
+	uint32_t	skip;
+
+	/* Only list these lines of a program, see print_prog() */
+	uint16_t	first_line, last_line;
+
+	/* List as blocks come in, see INCREMENTAL LISTING */
+	bool		stream;
+	struct stream	st;
+
+	/* Only the program named, see SELECTING */
+	bool		select;
+	bool		passing;	/* Reading one not asked for */
+	bool		done;		/* Listed the one asked for */
+	char		program[PROGNAMELEN];	/* Space padded */
+
+	/* Fixed point position, see SAMPLE POSITIONS */
+	uint64_t	pos;		/* Crossing ending the last period */
+	uint32_t	nsat;		/* Next of sc.sat to come up */
+	uint32_t	sat_base;	/* Index in pa of the periods pushed */
+	uint32_t	nhunt;
+	uint64_t	hunt[HUNT_RING];	/* Start of each hunt period */
+
+	/* Mark a block failing its checksum bad and go on, see RECOVERY */
+	bool		resync;
+	int32_t		ngood;		/* Blocks passing their checksum */
+	int32_t		nbad;		/* and failing it */
+
+	/*
+	 * The blocks of the program being read, in tape order. Emptied
+	 * at each EOF block but never shrunk, so after the first program
+	 * the decode path only allocates for a longer one.
+	 */
+	struct block	*blocks;
+	uint32_t	nblk;		/* Done, fr.f_blk is the one after */
+	uint32_t	blkcap;
+
+	/* The program listed, its Data blocks put together, kept the same */
+	struct prog_img	img;
+
+	int32_t		nblocks;	/* Started on the whole tape */
+	int32_t		nprogs;		/* Ended by an EOF block */
+	int32_t		nlisterr;	/* Programs that could not be listed */
+
+	/* Pass one, its periods all kept if keep */
+	struct scanner	sc;
+	struct period_buf pa;
+	bool		keep;
+
+	/* Where the results go, see struct cocotape_config */
+	FILE		*out;
+	cocotape_block_fn on_block;
+	cocotape_prog_fn on_prog;
+	void		*arg;
+};
+
+#define ZL 31
+#define ZH 1000
+#define OL 18
+#define OH 31
+
+static xing_fn_t xing_pick(void);
+static int  print_prog(FILE *out, struct prog_img *pi,
+		       const struct block *cb, uint32_t n, bool debug,
+		       uint16_t first, uint16_t last);
+static void print_catalog(FILE *out, const struct block *cb, uint32_t n);
+static bool stream_block(struct cocotape *dec, const struct block *b);
+static void stream_done(struct cocotape *dec, bool bad);
+static void hexdump(FILE *out, const void* data, size_t size);
+
+/* 
+ * For binary encoded CoCo BASIC Programs, 
+ * might be called tokenized BASIC Format 
+ *
+ * A token and its length, indexed by its code less 0x80. Every code up
+ * to 0xFF has an entry, one with no token has t_len 0.
+*/
+struct tok {
+	const char	*t_s;
+	uint8_t		t_len;
+};
+#define TOK(s)		{ s, sizeof(s) - 1 }
+#define TOK_MAX		7	/* "RESTORE", "STRING$" */
+#define TOK_BASE	0x80
+
+static const struct tok token[0x80] = {
+	/* Operator tokens */
+	
+	/* 0x80 */ TOK("FOR"), TOK("GO"), TOK("REM"), TOK("'"),
+	/* 0x84 */ TOK("ELSE"), TOK("IF"), TOK("DATA"), TOK("PRINT"),
+	/* 0x88 */ TOK("ON"), TOK("INPUT"), TOK("END"), TOK("NEXT"),
+	/* 0x8c */ TOK("DIM"), TOK("READ"), TOK("RUN"), TOK("RESTORE"),
+	/* 0x90	*/ TOK("RETURN"), TOK("STOP"), TOK("POKE"), TOK("CONT"),
+	/* 0x94	*/ TOK("LIST"), TOK("CLEAR"), TOK("NEW"), TOK("CLOAD"),
+	/* 0x98	*/ TOK("CSAVE"), TOK("OPEN"), TOK("CLOSE"), TOK("LLIST"),
+	/* 0x9c	*/ TOK("SET"), TOK("RESET"), TOK("CLS"), TOK("MOTOR"),
+	/* 0xa0	*/ TOK("SOUND"), TOK("AUDIO"), TOK("EXEC"), TOK("SKIPF"),
+	/* 0xa4	*/ TOK("TAB("), TOK("TO"), TOK("SUB"), TOK("THEN"),
+	/* 0xa8	*/ TOK("NOT"), TOK("STEP"), TOK("OFF"), TOK("+"),
+	/* 0xac	*/ TOK("-"), TOK("*"), TOK("/"), TOK("^"),
+	/* 0xb0	*/ TOK("AND"), TOK("OR"), TOK(">"), TOK("="),
+	/* 0xb4	*/ TOK("<"),
+
+	/* Extended BASIC adds these */
+	/* 0xb5 */ TOK("DEL"), TOK("EDIT"), TOK("TRON"),
+	/* 0xb8	*/ TOK("TROFF"), TOK("DEF"), TOK("LET"), TOK("LINE"),
+	/* 0xbc	*/ TOK("PCLS"), TOK("PSET"), TOK("PRESET"), TOK("SCREEN"),
+	/* 0xc0	*/ TOK("PCLEAR"), TOK("COLOR"), TOK("CIRCLE"), TOK("PAINT"),
+	/* 0xc4	*/ TOK("GET"), TOK("PUT"), TOK("DRAW"), TOK("PCOPY"),
+	/* 0xc8	*/ TOK("PMODE"), TOK("PLAY"), TOK("DLOAD"), TOK("RENUM"),
+	/* 0xcc */ TOK("FN"), TOK("USING"),
+
+	/* RSDOS adds these .. (from Dragon User 12/84) */
+	/* 0xce	*/ TOK("DIR"), TOK("DRIVE"),
+	/* 0xd0	*/ TOK("FIELD"), TOK("FILES"), TOK("KILL"), TOK("LOAD"),
+	/* 0xd4 */ TOK("LSET"), TOK("MERGE"), TOK("RENAME"), TOK("RSET"),
+	/* 0xd8	*/ TOK("SAVE"), TOK("WRITE"), TOK("VERIFY"), TOK("UNLOAD"),
+	/* 0xdc */ TOK("DSKINI"), TOK("BACKUP"), TOK("COPY"), TOK("DSKI$"),
+	/* 0xe0	*/ TOK("DSKO$"), TOK("DOS"),	/* DOS from Disk BASIC 1.1 */
+};
+
+static const struct tok ftoken[0x80] = {
+	/* Function tokens - proceeded by 0xff to differentiate from operators */
+
+	/* 0x80 */ TOK("SGN"), TOK("INT"), TOK("ABS"), TOK("USR"),
+	/* 0x84 */ TOK("RND"), TOK("SIN"), TOK("PEEK"), TOK("LEN"), 
+	/* 0x88 */ TOK("STR$"), TOK("VAL"), TOK("ASC"), TOK("CHR$"),
+	/* 0x8c */ TOK("EOF"), TOK("JOYSTK"), TOK("LEFT$"), TOK("RIGHT$"), 
+	/* 0x90 */ TOK("MID$"), TOK("POINT"), TOK("INKEY$"), TOK("MEM"),
+
+	/* Extended BASIC adds these */
+	/* 0x94 */ TOK("ATN"), TOK("COS"), TOK("TAN"), TOK("EXP"), 
+	/* 0x98 */ TOK("FIX"), TOK("LOG"), TOK("POS"), TOK("SQR"),
+	/* 0x9c */ TOK("HEX$"), TOK("VARPTR"), TOK("INSTR"), TOK("TIMER"), 
+	/* 0xa0 */ TOK("PPOINT"), TOK("STRING$"),
+
+	/* RSDOS adds these .. (from Dragon User 12/84) */
+	/* 0xa2 */ TOK("CVN"), TOK("FREE"),
+	/* 0xa4 */ TOK("LOC"), TOK("LOF"), TOK("MKN$"), TOK("AS"),
+};
+
+/* Appends a period, growing the array as needed */
+static inline int
+periods_add(struct cocotape *dec, uint16_t period)
+{
+	struct period_buf *pa = &dec->pa;
+	uint16_t	*p;
+	uint32_t	cap;
+
+	if (pa->n == pa->cap) {
+		cap = pa->cap ? pa->cap * 2 : SCAN_CHUNK;
+		p = realloc(pa->p, cap * sizeof(uint16_t));
+		if (!p) {
+			PRINT_ERROR(dec->out, "Failed to grow periods to %u", cap);
+			return(-1);
+		}
+		pa->p = p;
+		pa->cap = cap;
+	}
+	pa->p[pa->n++] = period;
+	return(0);
+}
+
+/* Notes the real length of a period being saturated */
+static int
+sat_add(struct scanner *sc, uint32_t i, uint64_t period)
+{
+	struct sat	*s;
+	uint32_t	cap;
+
+	if (sc->nsat == sc->satcap) {
+		cap = sc->satcap ? sc->satcap * 2 : 64;
+		if (!(s = realloc(sc->sat, cap * sizeof(struct sat))))
+			return(-1);
+		sc->sat = s;
+		sc->satcap = cap;
+	}
+	sc->sat[sc->nsat].s_i = i;
+	sc->sat[sc->nsat++].s_period = period;
+	return(0);
+}
+
+static void
+scan_init(struct scanner *sc)
+{
+	memset(sc, 0, sizeof(struct scanner));
+	sc->find_xings = xing_pick();
+}
+
+/*
+ * Pass one. Runs n samples through the zero crossing detector and 
+ * appends the period of each cycle found to dec->pa. Everything needed
+ * to pick up where the last call left off lives in dec->sc, so a 
+ * recording can be handed over in as many pieces as is convenient, up
+ * to SCAN_CHUNK at a time. Only fills in sc->at when instr, see
+ * DECODE VARIANTS.
+ */
+static ALWAYS_INLINE int
+scan_samples_t(struct cocotape *dec, const int16_t *data, uint32_t n,
+	       const bool instr)
+{
+	struct scanner	*sc = &dec->sc;
+	uint64_t	cross, period;
+	uint32_t	blk, nx, j, nat = 0;
+	int16_t		prev, p;
+
+	if (!n)
+		return(0);
+
+	if (!sc->primed) {
+		/* Very first sample only serves as the previous one */
+		sc->prev = data[0];
+		sc->primed = true;
+		sc->sample++;
+		data++;
+		n--;
+	}
+	prev = sc->prev;
+
+	for (uint32_t off = 0; off < n; off += blk) {
+		blk = n - off;
+		if (blk > XING_BLOCK)
+			blk = XING_BLOCK;
+
+		/* Only the crossings in this block get looked at */
+		nx = sc->find_xings(data + off, blk, prev, sc->xpos);
+
+		for (uint32_t x = 0; x < nx; x++) {
+			j = off + sc->xpos[x];
+			p = j ? data[j-1] : sc->prev;
+
+			/*
+			 * Falling zero crossing, between the previous
+			 * sample and this one, interpolated.
+			 */
+			cross = ((sc->sample + j - 1) << PERIOD_FRAC_BITS) +
+				(((uint32_t)p << PERIOD_FRAC_BITS) /
+				 (uint32_t)(p - data[j]));
+			period = cross - sc->cross;
+			sc->cross = cross;
+
+			if ((period >= PERIOD_MAX) &&
+			    sat_add(sc, dec->pa.n, period)) {
+				PRINT_ERROR(dec->out, "Failed to grow gaps");
+				return(-1);
+			}
+			if (periods_add(dec, (period > PERIOD_MAX) ?
+					PERIOD_MAX : period))
+				return(-1);
+			if (instr)
+				sc->at[nat++] = j;
+		}
+		prev = data[off + blk - 1];
+	}
+
+	sc->sample += n;
+	sc->prev = prev;
+
+	return(0);
+}
+
+static int
+scan_samples(struct cocotape *dec, const int16_t *data, uint32_t n)
+{
+	if (dec->sc.at)
+		return(scan_samples_t(dec, data, n, true));
+	return(scan_samples_t(dec, data, n, false));
+}
+
+/* Data points at REF_RATE to fixed point data points at rate */
+static uint32_t
+period_scale(uint32_t points, uint32_t rate)
+{
+	return((((uint64_t)points * rate << PERIOD_FRAC_BITS) + REF_RATE/2) /
+	       REF_RATE);
+}
+
+/*
+ * Turns inclusive data point ranges at REF_RATE into the decoder's half
+ * open fixed point windows at sample_rate.
+ */
+static void
+decode_windows(struct cocotape *dec, uint32_t sample_rate,
+	       int one_low, int one_high, int zero_low, int zero_high)
+{
+	dec->one_lo  = period_scale(one_low, sample_rate);
+	dec->one_hi  = period_scale(one_high + 1, sample_rate);
+	dec->zero_lo = period_scale(zero_low, sample_rate);
+	dec->zero_hi = period_scale(zero_high + 1, sample_rate);
+
+	/* A saturated period could be anything, never take it as a bit */
+	if (dec->one_hi > PERIOD_MAX)
+		dec->one_hi = PERIOD_MAX;
+	if (dec->zero_hi > PERIOD_MAX)
+		dec->zero_hi = PERIOD_MAX;
+}
+
+/*
+ * Sets the period windows from the CAL_CYCLES leader periods in the
+ * ring, see CALIBRATION above.
+ */
+static void
+calibrate(struct cocotape *dec)
+{
+	uint32_t	hist[CAL_BINS];
+	uint32_t	b, wlo, whi, split, lo;
+	double		sum = 0, sumlo = 0, mlo, mhi, var, best = -1;
+	double		one = 0, zero = 0;
+
+	memset(hist, 0, sizeof(hist));
+	for (int i = 0; i < CAL_CYCLES; i++) {
+		b = dec->cal_ring[i] >> CAL_BIN_SHIFT;
+		hist[(b < CAL_BINS) ? b : CAL_BINS - 1]++;
+		sum += (double)b;
+	}
+
+	/* Otsu, the split maximizing the between cluster variance */
+	wlo = 0;
+	for (b = 0; b < CAL_BINS - 1; b++) {
+		wlo += hist[b];
+		sumlo += (double)b * hist[b];
+		whi = CAL_CYCLES - wlo;
+		if (!wlo || !whi)
+			continue;
+		mlo = sumlo / wlo;
+		mhi = (sum - sumlo) / whi;
+		var = (double)wlo * whi * (mhi - mlo) * (mhi - mlo);
+		if (var > best) {
+			best = var;
+			one = mlo;
+			zero = mhi;
+		}
+	}
+
+	/* Back to fixed point, middle of the bins */
+	one = (one + 0.5) * (1 << CAL_BIN_SHIFT);
+	zero = (zero + 0.5) * (1 << CAL_BIN_SHIFT);
+	split = (one + zero) / 2;
+	lo = (2 * one > split + PERIOD_ONE) ? 2 * one - split : PERIOD_ONE;
+
+	dec->one_lo  = lo;
+	dec->one_hi  = split;
+	dec->zero_lo = split;
+
+	if (dec->verbose)
+		fprintf(dec->out, "Calibrated: 1 ~%u.%02u 0 ~%u.%02u, "
+			"1 [%u.%02u, %u.%02u) 0 [%u.%02u, %u.%02u)\n",
+			PERIOD_FMT((uint32_t)one), PERIOD_FMT((uint32_t)zero),
+			PERIOD_FMT(dec->one_lo), PERIOD_FMT(dec->one_hi),
+			PERIOD_FMT(dec->zero_lo), PERIOD_FMT(dec->zero_hi));
+}
+
+/*
+ * Watches the periods for a leader, a run of CAL_CYCLES alternating 
+ * short and long, and calibrates once per leader when one is found.
+ */
+static void
+calibrate_step(struct cocotape *dec, uint16_t period)
+{
+	uint32_t	lo, hi;
+	bool		up = (period > dec->cal_last);
+
+	lo = up ? dec->cal_last : period;
+	hi = up ? period : dec->cal_last;
+
+	if ((hi * 10 >= lo * CAL_RATIO_LO) && (hi * 10 <= lo * CAL_RATIO_HI) &&
+	    (!dec->cal_run || up != dec->cal_up)) {
+		dec->cal_ring[dec->cal_run % CAL_CYCLES] = period;
+		dec->cal_run++;
+	} else {
+		/* Out of the leader, or never in one */
+		dec->cal_run = 0;
+		dec->cal_done = false;
+	}
+	dec->cal_up = up;
+	dec->cal_last = period;
+
+	if (dec->cal_run >= CAL_CYCLES && !dec->cal_done) {
+		calibrate(dec);
+		dec->cal_done = true;
+	}
+}
+
+/* Prints the samples around the crossing at chunk index j */
+static void
+debug_samples(struct cocotape *dec, uint32_t j)
+{
+	/* Only what is in this chunk */
+	for(int64_t k=(int64_t)j-50; k<(int64_t)j+50; k++)
+		if ((k >= 0) && (k < dec->dbg_n))
+			fprintf(dec->out, "WAV: %d\n", dec->dbg_data[k]);
+}
+
+/* Starts on a new block, the one after the last done */
+static int
+new_block(struct cocotape *dec)
+{
+	struct framer	*f = &dec->fr;
+	struct block	*b;
+	uint32_t	cap;
+
+	if (dec->nblk == dec->blkcap) {
+		cap = dec->blkcap ? dec->blkcap * 2 : BLOCKCAP;
+		b = realloc(dec->blocks, cap * sizeof(struct block));
+		if (!b) {
+			PRINT_ERROR(dec->out, "Failed to grow blocks to %u", cap);
+			return(-1);
+		}
+		dec->blocks = b;
+		dec->blkcap = cap;
+	}
+
+	memset(f, 0, sizeof(struct framer));
+	f->f_state = BS_NEED_SYNCBYTE;
+	f->f_blk = &dec->blocks[dec->nblk];
+	f->f_blk->b_num = ++dec->nblocks;
+	f->f_blk->b_prog = dec->nprogs + 1;
+
+	return(0);
+}
+
+/*
+ * The block being filled is done, it joins the program. Its last bit
+ * ended at end, fixed point.
+ */
+static void
+end_block(struct cocotape *dec, bool bad, uint64_t end)
+{
+	struct framer	*f = &dec->fr;
+	struct block	*b = f->f_blk;
+
+	b->b_type = f->f_type;
+	b->b_length = f->f_length;
+	b->b_bad = bad;
+	b->b_end = (end >> PERIOD_FRAC_BITS) + 2;
+	dec->nblk++;
+	f->f_blk = NULL;
+
+	/* See SELECTING */
+	if (dec->select && (b->b_type == BT_NAME) && !bad)
+		dec->passing = memcmp(b->b_name.n_progname, dec->program,
+				      PROGNAMELEN) != 0;
+
+	if (dec->on_block)
+		dec->on_block(dec->arg, b);
+
+	/* Listed already, see INCREMENTAL LISTING */
+	if (dec->stream && stream_block(dec, b))
+		dec->nblk--;
+}
+
+/*
+ * Hands the program in the blocks to on_prog, or without one lists it
+ * to out if it made it through.
+ */
+static void
+prog_print(struct cocotape *dec)
+{
+	struct block	*b, *end = dec->blocks + dec->nblk;
+	int		bad = 0;
+
+	if (dec->passing)
+		return;
+	if (dec->select)
+		dec->done = true;
+
+	if (dec->on_prog) {
+		dec->on_prog(dec->arg, dec->blocks, dec->nblk);
+		return;
+	}
+
+	if (dec->quiet)
+		return;
+
+	if (dec->catalog) {
+		print_catalog(dec->out, dec->blocks, dec->nblk);
+		return;
+	}
+
+	for (b = dec->blocks; b < end; b++)
+		if (b->b_bad)
+			bad++;
+
+	/* Listed as it came in, as far as it got */
+	if (dec->stream)
+		stream_done(dec, bad);
+
+	if (!bad) {
+		if (!dec->stream &&
+		    print_prog(dec->out, &dec->img, dec->blocks, dec->nblk,
+			       dec->debug, dec->first_line, dec->last_line))
+			dec->nlisterr++;
+		return;
+	}
+
+	b = dec->blocks;
+	if (!dec->stream && dec->nblk && (b->b_type == BT_NAME) && !b->b_bad)
+		fprintf(dec->out, "Program: %8.8s\n", b->b_name.n_progname);
+	fprintf(dec->out, "Skipped, bad block(s):");
+	for (; b < end; b++)
+		if (b->b_bad)
+			fprintf(dec->out, " %d", b->b_num);
+	fprintf(dec->out, "\n");
+}
+
+/* Prints and empties the blocks, ready for the next program */
+static void
+prog_done(struct cocotape *dec)
+{
+	prog_print(dec);
+	dec->nblk = 0;
+	dec->nprogs++;
+	dec->passing = dec->select;
+}
+
+/* Prints a Namefile block's fields */
+static void
+debug_namefile(FILE *out, const struct namefile *nf)
+{
+	fprintf(out, "Name: %.8s\n", nf->n_progname);
+	fprintf(out, "Found FILETYPE: 0x%02x\n", nf->n_filetype);
+	fprintf(out, "Found ASCIIFLAG: 0x%02x\n", nf->n_asciiflag);
+	fprintf(out, "Found GAPFLAG: 0x%02x\n", nf->n_gapflag);
+	fprintf(out, "Machine Language Start: 0x%04x\n", *(uint16_t *)nf->n_mlstart);
+	fprintf(out, "Machine Language Load: 0x%04x\n", *(uint16_t *)nf->n_mlload);
+}
+
+/* What each byte after the sync byte does and which state follows it */
+static const struct frame_step {
+	bool		fs_sum;		/* Part of the checksum */
+	enum block_state fs_next;
+} frame_steps[] = {
+	[BS_NEED_BLOCKTYPE]	= { true,  BS_NEED_LENGTH },
+	[BS_NEED_LENGTH]	= { true,  BS_NEED_DATA },
+	[BS_NEED_DATA]		= { true,  BS_NEED_CKSUM },
+	[BS_NEED_CKSUM]		= { false, BS_NEED_LEADBYTE },
+	[BS_NEED_LEADBYTE]	= { false, BS_DONE },
+};
+
+/* Length each block type must have, BL_ANY or BL_BAD when not fixed */
+#define BL_ANY		-1
+#define BL_BAD		-2
+
+static const int16_t block_len[256] = {
+	[0 ... 255]	= BL_BAD,
+	[BT_NAME]	= NAMEBLOCKLEN,
+	[BT_DATA]	= BL_ANY,
+	[BT_EOF]	= 0,
+};
+
+/*
+ * A block failed its checksum, the end of the decode or marked bad to
+ * carry on past it, see RECOVERY. Read here or put back together from
+ * pieces, it is reported the same. Returns non-zero to stop.
+ */
+static int
+bad_block(struct cocotape *dec, const struct block *b)
+{
+	if (!dec->resync) {
+		PRINT_ERROR(dec->out, "Decode Error: chksum 0x%02x != 0x%02x, "
+			    "block %d at sample %llu\n", b->b_cksum, b->b_sum,
+			    b->b_num, (unsigned long long)b->b_start);
+		return(1);
+	}
+
+	if (!dec->quiet)
+		fprintf(dec->out, "Block %d: bad checksum 0x%02x != 0x%02x, "
+			"resyncing\n", b->b_num, b->b_cksum, b->b_sum);
+	dec->nbad++;
+	return(0);
+}
+
+/*
+ * Takes the next byte of the block being read, called once the sync
+ * byte has been found and then for every 8 bits after it. Only prints
+ * debug output when instr, see DECODE VARIANTS.
+ */
+static ALWAYS_INLINE int
+frame_byte(struct cocotape *dec, uint8_t byte, const bool instr)
+{
+	struct framer	*f = &dec->fr;
+	struct block	*b = f->f_blk;
+	const struct frame_step *fs = &frame_steps[f->f_state];
+	enum block_state next = fs->fs_next;
+
+	if (fs->fs_sum)
+		f->f_cksum += byte;
+
+	switch (f->f_state) {
+	case BS_NEED_BLOCKTYPE:
+		if (instr && dec->debug)
+			fprintf(dec->out, "Found BLOCK TYPE: 0x%02x\n", byte);
+		if (block_len[byte] == BL_BAD) {
+			if (instr && dec->debug)
+				fprintf(dec->out, "Found bad block type, resetting\n");
+			next = BS_NEED_SYNCBYTE;
+			f->f_cksum = 0;
+			break;
+		}
+		f->f_type = byte;
+		break;
+
+	case BS_NEED_LENGTH:
+		if (instr && dec->debug)
+			fprintf(dec->out, "Found LENGTH: 0x%02x\n", byte);
+		if ((block_len[f->f_type] != BL_ANY) &&
+		    (block_len[f->f_type] != byte)) {
+			if (!dec->quiet && !SKIP_DATA(dec)) {
+				fprintf(dec->out, "TYPE: 0x%02x\n", f->f_type);
+				fprintf(dec->out, "Found bad block len, resetting\n");
+			}
+			next = BS_NEED_SYNCBYTE;
+			f->f_cksum = 0;
+			break;
+		}
+		f->f_length = byte;
+		b->b_data[byte] = 0;
+		if (!byte)
+			next = BS_NEED_CKSUM;
+		if (SKIP_DATA(dec) && byte && (f->f_type == BT_DATA)) {
+			/* Data and checksum at their shortest, see CATALOG */
+			dec->skip = (uint32_t)(byte + 1) * 8;
+			next = BS_DONE;
+		}
+		break;
+
+	case BS_NEED_DATA:
+		b->b_data[f->f_i++] = byte;
+		if (f->f_i < f->f_length)
+			return(0);
+		if (instr && dec->debug) {
+			if (f->f_type == BT_NAME) {
+				debug_namefile(dec->out, &b->b_name);
+			} else {
+				fprintf(dec->out, "Found DATA: \n");
+				fprintf(dec->out, "Length: 0x%02x\n", f->f_i);
+				hexdump(dec->out, b->b_data, f->f_i);
+			}
+		}
+		break;
+
+	case BS_NEED_CKSUM:
+		if (instr && dec->debug) {
+			fprintf(dec->out, "Found CKSUM: 0x%02x\n", byte);
+			fprintf(dec->out, "Checksum: 0x%02x\n", f->f_cksum);
+		}
+		b->b_cksum = byte;
+		b->b_sum = f->f_cksum;
+		if (byte != f->f_cksum) {
+			if (bad_block(dec, b))
+				return(1);
+
+			/*
+			 * Could be framed wrong, look for the next
+			 * sync byte right away, not past a leader.
+			 */
+			f->f_bad = true;
+			next = BS_DONE;
+			break;
+		}
+		dec->ngood++;
+		break;
+
+	case BS_NEED_LEADBYTE:
+		if (instr && dec->debug)
+			fprintf(dec->out, "Found LEADBYTE: 0x%02x\n", byte);
+		break;
+
+	default:
+		PRINT_ERROR(dec->out, "Bad Block state\n");
+		return(1);
+	}
+
+	f->f_state = next;
+	return(0);
+}
+
+/*
+ * Pass two. Classifies n periods as 1s and 0s and feeds the resulting
+ * bits to frame_byte() a byte at a time. Like pass one it can be 
+ * handed the periods in as many pieces as is convenient. Only has debug
+ * output compiled in when instr, see DECODE VARIANTS.
+ */
+static ALWAYS_INLINE int
+decode_periods_t(struct cocotape *dec, const uint16_t *p, uint32_t n,
+		 const bool instr)
+{
+	struct framer	*f = &dec->fr;
+	uint32_t	period;
+	uint64_t	from;
+
+	for (uint32_t i = 0; i < n; i++) {
+		if (!f->f_blk && new_block(dec))
+			return(-1);
+
+		period = p[i];
+
+		/* Where this period ends, see SAMPLE POSITIONS */
+		from = dec->pos;
+		if ((period == PERIOD_MAX) && (dec->nsat < dec->sc.nsat) &&
+		    (dec->sc.sat[dec->nsat].s_i == dec->sat_base + i))
+			dec->pos += dec->sc.sat[dec->nsat++].s_period;
+		else
+			dec->pos += period;
+
+		if (dec->skip) {
+			/* A Data block not read, see CATALOG */
+			dec->skip--;
+			continue;
+		}
+
+		/* Leaders only come before a sync byte */
+		if (dec->cal && f->f_state == BS_NEED_SYNCBYTE)
+			calibrate_step(dec, period);
+
+		if (instr && dec->debug && f->f_state == BS_NEED_LENGTH)
+			fprintf(dec->out, "count: %u.%02u\n", PERIOD_FMT(period));
+
+		if ((period >= dec->one_lo) &&
+		    (period < dec->one_hi)) {
+			/* Found a 1 */
+			f->f_byte = (f->f_byte >> 1) | 0x80;
+		} else if ((period >= dec->zero_lo) &&
+			 (period < dec->zero_hi)) {
+			/* Found a 0 */
+			f->f_byte = (f->f_byte >> 1);
+		} else {
+			if (instr && dec->debug) {
+				fprintf(dec->out, "Not 1200/2400Hz waveform: %u.%02u\n",
+					PERIOD_FMT(period));
+				if (dec->dbg_data && (f->f_state == BS_NEED_DATA))
+					debug_samples(dec, dec->dbg_at[i]);
+			}
+		}
+		//printf("Curr Byte: 0x%02x\n", f->f_byte);
+
+		if (f->f_state == BS_NEED_SYNCBYTE) {
+			dec->hunt[dec->nhunt++ % HUNT_RING] = from;
+
+			/* Any bit could be the last of it */
+			if (f->f_byte == SYNCBYTE) {
+				/* Found header */
+				if (instr && dec->debug)
+					fprintf(dec->out, "Found header byte: 0x%02x\n",
+						f->f_byte);
+				f->f_byte = 0;
+				f->f_nbit = 0;
+				f->f_state = BS_NEED_BLOCKTYPE;
+				f->f_blk->b_start = dec->hunt[dec->nhunt %
+							      HUNT_RING] >>
+					PERIOD_FRAC_BITS;
+			}
+			continue;
+		}
+
+		if (++f->f_nbit < 8)
+			continue;
+
+		if (frame_byte(dec, f->f_byte, instr))
+			return(1);
+		f->f_byte = 0;
+		f->f_nbit = 0;
+
+		if (f->f_state == BS_DONE) { 
+			/* Time to start another block */
+			/* A gap after it is not part of it */
+			end_block(dec, f->f_bad,
+				  (dec->pos - from > dec->zero_hi) ?
+				  from + dec->zero_hi : dec->pos);
+			if (f->f_type == BT_EOF) {
+				/* Completed a prog */
+				prog_done(dec);
+				if (dec->done)
+					return(0);
+			}
+		}
+	}
+
+	return(0);
+}
+
+static int
+decode_periods_prod(struct cocotape *dec, const uint16_t *p, uint32_t n)
+{
+	return(decode_periods_t(dec, p, n, false));
+}
+
+static int
+decode_periods_instr(struct cocotape *dec, const uint16_t *p, uint32_t n)
+{
+	return(decode_periods_t(dec, p, n, true));
+}
+
+static int
+decode_periods(struct cocotape *dec, const uint16_t *p, uint32_t n)
+{
+	return(dec->run(dec, p, n));
+}
+
+/* End of the recording, flush out whatever was decoded */
+static void
+decode_finish(struct cocotape *dec)
+{
+	struct block	*b, *end = dec->blocks + dec->nblk;
+
+	if (dec->nblk || dec->st.s_on)
+		prog_print(dec);
+
+	if (dec->select && !dec->done && !dec->quiet)
+		fprintf(dec->out, "Program %.8s not found\n", dec->program);
+
+	if (dec->nbad && !dec->quiet)
+		fprintf(dec->out, "%d block(s) failed checksum, %d passed\n",
+			dec->nbad, dec->ngood);
+
+	if (dec->verbose) {
+		fprintf(dec->out, "Decoded %d blocks\n", dec->nblocks);
+		for (b = dec->blocks; b < end; b++) {
+			switch (b->b_type) {
+			case BT_NAME:
+				fprintf(dec->out, "Name Block\n");
+				break;
+			case BT_DATA:
+				fprintf(dec->out, "DATA Block (%d)\n", b->b_length);
+				break;
+			case BT_EOF:
+				fprintf(dec->out, "EOF Block\n");
+				break;
+			default:
+				fprintf(dec->out, "Bad block type %d\n", b->b_type);
+				break;
+			}
+		}
+	}
+
+	dec->nblk = 0;
+	dec->fr.f_blk = NULL;
+}
+
+/* A listing on its way to out, see LISTING OUTPUT */
+struct obuf {
+	FILE		*o_out;
+	size_t		o_n;
+	char		o_buf[OBUF_SIZE];
+};
+
+static void
+ob_flush(struct obuf *ob)
+{
+	if (ob->o_n)
+		fwrite(ob->o_buf, 1, ob->o_n, ob->o_out);
+	ob->o_n = 0;
+}
+
+/* n is never more than a line number or a token, far short of a flush */
+static inline void
+ob_put(struct obuf *ob, const void *p, size_t n)
+{
+	if (ob->o_n + n > OBUF_SIZE)
+		ob_flush(ob);
+	memcpy(ob->o_buf + ob->o_n, p, n);
+	ob->o_n += n;
+}
+
+static inline void
+ob_putc(struct obuf *ob, char c)
+{
+	if (ob->o_n == OBUF_SIZE)
+		ob_flush(ob);
+	ob->o_buf[ob->o_n++] = c;
+}
+
+/* As "%5d ", a BASIC line number is never more than 5 digits */
+static inline void
+ob_lineno(struct obuf *ob, uint16_t lineno)
+{
+	char		x[6] = { ' ', ' ', ' ', ' ', ' ', ' ' };
+	int		i = 4;
+
+	do {
+		x[i--] = '0' + lineno % 10;
+		lineno /= 10;
+	} while (lineno);
+	ob_put(ob, x, sizeof(x));
+}
+
+/* Most any one byte of a line expands to, a token or "\xHH" */
+#define DETOK_MAX	TOK_MAX
+
+/*
+ * Expands a tokenized line into ob. Printable characters are copied, 
+ * tokens expanded, 0xFF and the byte after it as a function token, and
+ * anything else unprintable written as "\xHH", H an ascii hexdigit,
+ * nulls left out. A code with no token, or 0xFF without a function 
+ * token after it, is unprintable. ex "O\x01--\x7F\xFF"
+ *
+ * Works straight in ob's buffer, as much of the line at a time as is 
+ * sure to fit at DETOK_MAX per byte, flushing in between.
+ */
+static void
+detokenize(struct obuf *ob, const uint8_t *line, size_t size)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	const struct tok *t;
+	size_t		i = 0, stop;
+	uint8_t		c;
+	char		*p;
+
+	while (i < size) {
+		if (OBUF_SIZE - ob->o_n < DETOK_MAX)
+			ob_flush(ob);
+		stop = i + (OBUF_SIZE - ob->o_n) / DETOK_MAX;
+		if (stop > size)
+			stop = size;
+
+		for (p = ob->o_buf + ob->o_n; i < stop; i++) {
+			c = line[i];
+			if ((c >= ' ') && (c < 0x7F)) {
+				*p++ = c;
+				continue;
+			}
+
+			t = NULL;
+			if ((c == 0xFF) && (i + 1 < size) &&
+			    (line[i + 1] >= TOK_BASE) &&
+			    ftoken[line[i + 1] - TOK_BASE].t_len)
+				t = &ftoken[line[++i] - TOK_BASE];
+			else if ((c >= TOK_BASE) && token[c - TOK_BASE].t_len)
+				t = &token[c - TOK_BASE];
+
+			if (t) {
+				memcpy(p, t->t_s, t->t_len);
+				p += t->t_len;
+			} else if (c) {
+				p[0] = '\\';
+				p[1] = 'x';
+				p[2] = hex[c >> 4];
+				p[3] = hex[c & 0xF];
+				p += 4;
+			}
+		}
+		ob->o_n = p - ob->o_buf;
+	}
+}
+
+/*
+ * Lays the Data blocks of a program, cb up to end, end to end in img,
+ * the program as the CoCo holds it in RAM. Returns how many bytes that
+ * is, with img NULL only counts them.
+ */
+static size_t
+prog_image(const struct block *cb, const struct block *end, uint8_t *img)
+{
+	size_t		n = 0;
+
+	for (; cb < end; cb++) {
+		if (cb->b_type != BT_DATA)
+			continue;
+		if (img)
+			memcpy(img + n, cb->b_data, cb->b_length);
+		n += cb->b_length;
+	}
+	return(n);
+}
+
+/*
+ * The line at lk_pos of a program image of n bytes into pl, and lk_pos
+ * on to the one after it. Returns 1 for a line, 0 after the last, -1 if
+ * the image ends before the line does, it may not all be in yet.
+ */
+static int
+next_line(struct linker *lk, const uint8_t *img, size_t n,
+	  struct prog_line *pl)
+{
+	size_t		pos = lk->lk_pos, next;
+	const uint8_t	*nul;
+	uint16_t	link;
+
+	if (pos + 4 > n)
+		return(((pos + 2 <= n) && !img[pos] && !img[pos + 1]) ? 0 : -1);
+	link = ((uint16_t)img[pos] << 8) | img[pos + 1];
+	if (!link)
+		return(0);
+
+	next = (uint16_t)(link - lk->lk_base);
+	if (!lk->lk_based || (next <= pos + 4) || (next > n) ||
+	    img[next - 1]) {
+		/* The first line, or one whose address is off */
+		if (!(nul = memchr(img + pos + 4, 0, n - pos - 4)))
+			return(-1);
+		next = nul + 1 - img;
+		if (!lk->lk_based) {
+			lk->lk_base = link - next;
+			lk->lk_based = true;
+		} else {
+			lk->lk_relinked++;
+		}
+	}
+
+	pl->pl_off = pos + 4;
+	pl->pl_len = next - 1 - (pos + 4);
+	pl->pl_num = ((uint16_t)img[pos + 2] << 8) | img[pos + 3];
+	lk->lk_pos = next;
+	return(1);
+}
+
+/*
+ * Lists lines first through last of a program, all of them for 0 and
+ * UINT16_MAX. The lines are walked a jump each, and with line numbers
+ * going up as they should the walk stops at the first past last. The
+ * image is put together in pi, grown only for a longer program.
+ */
+static int
+print_prog(FILE *out, struct prog_img *pi, const struct block *cb,
+	   uint32_t n, bool debug, uint16_t first, uint16_t last)
+{
+	const struct block *end = cb + n;
+	struct linker lk;
+	struct prog_line pl;
+	struct obuf ob;
+	uint8_t *img;
+	size_t len, cap;
+	uint32_t nl = 0;
+	uint16_t num = 0;
+	bool sorted = true;
+	int rc;
+
+	if (n && (cb->b_type == BT_NAME)) {
+		fprintf(out, "Program: %8.8s\n", cb->b_name.n_progname);
+	}
+		       
+	while ((cb < end) && (cb->b_type != BT_DATA))
+		cb++;
+
+	if (cb == end) return(0);
+	
+	if (!(len = prog_image(cb, end, NULL)))
+		return(0);
+
+	if (len > pi->pi_cap) {
+		for (cap = pi->pi_cap ? pi->pi_cap : IMGCAP; cap < len; )
+			cap *= 2;
+		if (!(img = realloc(pi->pi_buf, cap))) {
+			PRINT_ERROR(out, "Failed to grow program image to %zu",
+				    cap);
+			return(-1);
+		}
+		pi->pi_buf = img;
+		pi->pi_cap = cap;
+	}
+	img = pi->pi_buf;
+	prog_image(cb, end, img);
+
+	memset(&lk, 0, sizeof(lk));
+	ob.o_out = out;
+	ob.o_n = 0;
+	while ((rc = next_line(&lk, img, len, &pl)) > 0) {
+		if (nl++ && (pl.pl_num <= num))
+			sorted = false;
+		num = pl.pl_num;
+		if ((num < first) || (num > last)) {
+			/* None after the first past last can be wanted */
+			if (sorted && (num > last))
+				break;
+			continue;
+		}
+		ob_lineno(&ob, num);
+		detokenize(&ob, img + pl.pl_off, pl.pl_len);
+		ob_putc(&ob, '\n');
+	}
+	ob_flush(&ob);
+
+	/* Saved without the last next line address is just as done */
+	if (((rc < 0) && (lk.lk_pos + 2 > len)) || (rc > 0))
+		rc = 0;
+	if (debug)
+		fprintf(out, "Load base 0x%04x, %u lines, %u relinked\n",
+			lk.lk_base, nl, lk.lk_relinked);
+	if (rc < 0)
+		fprintf(out, "Program ends part way through the line after "
+			"%u\n", num);
+
+	return(rc);
+}
+
+/*
+ * Lists every line of the program being read that is all in, keeping
+ * what is left of the image. With last no more is coming, a line not
+ * all in never will be.
+ */
+static void
+stream_lines(struct cocotape *dec, bool last)
+{
+	struct stream	*st = &dec->st;
+	struct prog_line pl;
+	struct obuf	ob;
+	size_t		d;
+	int		rc;
+
+	ob.o_out = dec->out;
+	ob.o_n = 0;
+	while ((rc = next_line(&st->s_lk, st->s_buf, st->s_n, &pl)) > 0) {
+		if (st->s_nline++ && (pl.pl_num <= st->s_num))
+			st->s_unsorted = true;
+		st->s_num = pl.pl_num;
+		if ((pl.pl_num < dec->first_line) ||
+		    (pl.pl_num > dec->last_line)) {
+			/* Stops as print_prog() does */
+			if (!st->s_unsorted && (pl.pl_num > dec->last_line)) {
+				st->s_stop = true;
+				break;
+			}
+			continue;
+		}
+		ob_lineno(&ob, pl.pl_num);
+		detokenize(&ob, st->s_buf + pl.pl_off, pl.pl_len);
+		ob_putc(&ob, '\n');
+	}
+	ob_flush(&ob);
+
+	if (!rc || st->s_stop) {
+		st->s_stop = true;
+	} else if (last) {
+		/* Saved without the last next line address is just as done */
+		if (st->s_lk.lk_pos + 2 <= st->s_n) {
+			fprintf(dec->out, "Program ends part way through the "
+				"line after %u\n", st->s_num);
+			dec->nlisterr++;
+		}
+	} else {
+		/* Keep the rest, its addresses move down with it */
+		d = st->s_lk.lk_pos;
+		memmove(st->s_buf, st->s_buf + d, st->s_n - d);
+		st->s_n -= d;
+		st->s_lk.lk_pos = 0;
+		st->s_lk.lk_base += d;
+		st->s_drop += d;
+	}
+	fflush(dec->out);
+}
+
+/*
+ * A block of the program being read is done, see INCREMENTAL LISTING.
+ * Returns true for a Data block that was listed and need not be kept.
+ */
+static bool
+stream_block(struct cocotape *dec, const struct block *b)
+{
+	struct stream	*st = &dec->st;
+
+	if (dec->passing)
+		return(false);
+	st->s_on = true;
+
+	switch (b->b_type) {
+	case BT_NAME:
+		if (!b->b_bad) {
+			fprintf(dec->out, "Program: %8.8s\n",
+				b->b_name.n_progname);
+			fflush(dec->out);
+		}
+		return(false);
+
+	case BT_DATA:
+		if (b->b_bad) {
+			st->s_stop = true;
+			return(false);
+		}
+		if (st->s_stop)
+			return(true);
+		if (st->s_n + b->b_length > STREAM_BUF) {
+			fprintf(dec->out, "No end to the line after %u\n",
+				st->s_num);
+			dec->nlisterr++;
+			st->s_stop = true;
+			return(true);
+		}
+		memcpy(st->s_buf + st->s_n, b->b_data, b->b_length);
+		st->s_n += b->b_length;
+		stream_lines(dec, false);
+		return(true);
+
+	default:
+		return(false);
+	}
+}
+
+/* The program being read is over, bad if any of its blocks were */
+static void
+stream_done(struct cocotape *dec, bool bad)
+{
+	struct stream	*st = &dec->st;
+
+	if (st->s_on && !bad && !st->s_stop)
+		stream_lines(dec, true);
+	if (st->s_on && !bad && dec->debug)
+		fprintf(dec->out, "Load base 0x%04x, %u lines, %u relinked\n",
+			(uint16_t)(st->s_lk.lk_base - st->s_drop), st->s_nline,
+			st->s_lk.lk_relinked);
+	st->s_on = false;
+	st->s_stop = false;
+	st->s_unsorted = false;
+	st->s_nline = 0;
+	st->s_num = 0;
+	st->s_n = 0;
+	st->s_drop = 0;
+	memset(&st->s_lk, 0, sizeof(struct linker));
+}
+
+/* A Namefile block's 6809 big endian addresses */
+#define NF_ADDR(a)	(((uint16_t)(a)[0] << 8) | (a)[1])
+
+/*
+ * Lists a program read with catalog set as one line, name, file type,
+ * ASCII or binary, ML start and load addresses and the size its Data
+ * blocks say it has, see CATALOG above.
+ */
+static void
+print_catalog(FILE *out, const struct block *cb, uint32_t n)
+{
+	static const char *ftype[] = {
+		[FT_BASIC]	= "BASIC",
+		[FT_DATA]	= "DATA",
+		[FT_ML]		= "ML",
+	};
+	const struct namefile *nf = NULL;
+	const struct block *b, *end = cb + n;
+	uint32_t	bytes = 0, ndata = 0;
+	bool		bad = false;
+
+	for (b = cb; b < end; b++) {
+		if (b->b_bad)
+			bad = true;
+		else if ((b->b_type == BT_NAME) && !nf)
+			nf = &b->b_name;
+		else if (b->b_type == BT_DATA) {
+			bytes += b->b_length;
+			ndata++;
+		}
+	}
+
+	if (!nf) {
+		fprintf(out, "%-8s %-5s %c  Start: ----  Load: ----",
+			"????????", "?", '?');
+	} else {
+		fprintf(out, "%-8.8s ", nf->n_progname);
+		if (nf->n_filetype <= FT_ML)
+			fprintf(out, "%-5s ", ftype[nf->n_filetype]);
+		else
+			fprintf(out, "0x%02x  ", nf->n_filetype);
+		fprintf(out, "%c  Start: %04X  Load: %04X",
+			(nf->n_asciiflag == AF_ASCII) ? 'A' : 'B',
+			NF_ADDR(nf->n_mlstart), NF_ADDR(nf->n_mlload));
+	}
+	fprintf(out, "  %5u bytes in %u blocks%s\n", bytes, ndata,
+		bad ? ", bad block(s)" : "");
+}
+
+/*
+ * ZERO CROSSING KERNELS
+ * Finding falling crossings is a sign test on every sample, the rest of
+ * the decoder only runs at the few that are found. A kernel scans n
+ * samples and writes the index j of each sample where data[j] < 0 and
+ * the one before it (prev for j == 0) is >= 0, returning how many.
+ *
+ * The vector kernels gather the sign bits of 64 samples into a mask, a
+ * crossing is a set bit whose lower neighbour is clear, and those are
+ * walked off with count trailing zeros. Whatever doesn't fill a whole 
+ * 64 sample block goes through the plain C kernel.
+ */
+static uint32_t
+xings_c(const int16_t *data, uint32_t n, int16_t prev, uint32_t *pos)
+{
+	uint32_t np = 0;
+
+	for (uint32_t j = 0; j < n; j++) {
+		if ((data[j] < 0) && (prev >= 0))
+			pos[np++] = j;
+		prev = data[j];
+	}
+	return(np);
+}
+
+#ifdef HAVE_X86_SIMD
+/* Emits the crossings in a 64 sample sign mask, returns the new carry */
+static inline uint64_t
+xings_mask(uint64_t neg, uint64_t carry, uint32_t base, uint32_t *pos,
+	   uint32_t *np)
+{
+	uint64_t m = neg & ~((neg << 1) | carry);
+
+	while (m) {
+		pos[(*np)++] = base + __builtin_ctzll(m);
+		m &= m - 1;
+	}
+	return(neg >> 63);
+}
+
+/* Samples i through n-1 left over from the vector loop */
+static uint32_t
+xings_tail(const int16_t *data, uint32_t i, uint32_t n, int16_t prev,
+	   uint32_t *pos)
+{
+	uint32_t np;
+
+	np = xings_c(data + i, n - i, i ? data[i - 1] : prev, pos);
+	for (uint32_t k = 0; k < np; k++)
+		pos[k] += i;
+	return(np);
+}
+
+static uint32_t
+xings_sse2(const int16_t *data, uint32_t n, int16_t prev, uint32_t *pos)
+{
+	uint64_t carry = (prev < 0), neg;
+	uint32_t np = 0, i;
+
+	for (i = 0; i + 64 <= n; i += 64) {
+		neg = 0;
+		for (int k = 0; k < 64; k += 16) {
+			/* saturating pack keeps the sign of every sample */
+			__m128i a = _mm_loadu_si128((const __m128i *)(data + i + k));
+			__m128i b = _mm_loadu_si128((const __m128i *)(data + i + k + 8));
+
+			neg |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+				_mm_packs_epi16(a, b)) << k;
+		}
+		carry = xings_mask(neg, carry, i, pos, &np);
+	}
+
+	if (i < n)
+		np += xings_tail(data, i, n, prev, pos + np);
+	return(np);
+}
+
+__attribute__((target("avx2"))) static uint32_t
+xings_avx2(const int16_t *data, uint32_t n, int16_t prev, uint32_t *pos)
+{
+	uint64_t carry = (prev < 0), neg;
+	uint32_t np = 0, i;
+
+	for (i = 0; i + 64 <= n; i += 64) {
+		neg = 0;
+		for (int k = 0; k < 64; k += 32) {
+			__m256i a = _mm256_loadu_si256((const __m256i *)(data + i + k));
+			__m256i b = _mm256_loadu_si256((const __m256i *)(data + i + k + 16));
+			__m256i p = _mm256_permute4x64_epi64(
+				_mm256_packs_epi16(a, b), AVX2_PACK_ORDER);
+
+			neg |= (uint64_t)(uint32_t)_mm256_movemask_epi8(p) << k;
+		}
+		carry = xings_mask(neg, carry, i, pos, &np);
+	}
+
+	if (i < n)
+		np += xings_tail(data, i, n, prev, pos + np);
+	return(np);
+}
+#endif /* HAVE_X86_SIMD */
+
+/* Best crossing kernel this CPU can run */
+static xing_fn_t
+xing_pick(void)
+{
+#ifdef HAVE_X86_SIMD
+	return(cocotape_has_avx2() ? xings_avx2 : xings_sse2);
+#else
+	return(xings_c);
+#endif
+}
+
+/*
+ * True if the vector paths that need more than SSE2 can be used.
+ * Decoders made at once on several threads may each look it up, they
+ * all find the same, atomically so it is no race.
+ */
+bool
+cocotape_has_avx2(void)
+{
+#ifdef HAVE_X86_SIMD
+	static int avx2 = -1;
+	int		has;
+
+	if ((has = __atomic_load_n(&avx2, __ATOMIC_ACQUIRE)) < 0) {
+		__builtin_cpu_init();
+		has = __builtin_cpu_supports("avx2") ? 1 : 0;
+		__atomic_store_n(&avx2, has, __ATOMIC_RELEASE);
+	}
+	return(has);
+#else
+	return(false);
+#endif
+}
+
+static void
+hexdump(FILE *out, const void* data, size_t size)
+{
+	char offset[10];	/* Byte Offset string */
+	char line[81];		/* Current line */
+	char lline[81];		/* Last line for comparison */
+#define SEPSTR " |  "
+	char sep[81];		/* Built separator string */
+	char hexch[5];		/* Formatted hex character */
+	size_t lines, l, i, j, bpl=16, lb, bsl=3, lo, repeat = 0;
+
+	/*
+	 * dump the output line by line. This way if lines are
+	 * repeated they can be detected and not printed again.
+	 * The hex portion is a little inefficient as it is O(x^2)
+	 * but is simple to read.
+	 *
+	 * bpl is Bytes per Line
+	 * lb is Line Bytes, mostly lb = bpl except for last line
+	 * bsl is Byte String Length, length of single byte in ascii + " "
+	 * lo is Line Offset
+	 */
+	lines = (size / bpl) + ((size % bpl)?1:0);
+	lline[0] = '\0';
+	lb = bpl;
+	for (l=0,i=0; l<lines; i+=lb, l++) {
+
+		/* Last line update bpl if necessary */
+		if (l == (lines - 1))
+			if (size % bpl)
+				lb = size % bpl;
+
+		/* Offset */
+		sprintf(offset, "%08x ", (unsigned int)(l * bpl));
+
+		/* Hex dump */
+		line[0] = '\0';
+		for (j = 0; j < lb; ++j) {
+			sprintf(hexch, "%02X ", ((unsigned char*)data)[i+j]);
+			strcat(line, hexch);
+		}
+
+		/* Add Hex Ascii Separator, variable width */
+		sprintf(sep, "%*s",
+			(int)(((bpl - lb) * bsl) + strlen(SEPSTR)), SEPSTR);
+		strcat(line, sep);
+
+		/* Ascii dump */
+		lo = strlen(line);
+		for (j = 0; j < lb; ++j) {
+			if (isprint(((unsigned char *)data)[i+j]))
+				line[lo] = ((char *)data)[i+j];
+			else
+				line[lo] = '.';
+			lo++;
+		}
+		line[lo] = '\0';
+
+		/* check if repeated */
+		if (strcmp(line, lline)) {
+			/* Non repeated line, print it */
+			if (repeat)
+				fprintf(out, "    Last line repeated %ld time(s)\n",
+					repeat);
+
+			fprintf(out, "%s%s\n", offset, line);
+
+			/* Save last line */
+			strcpy(lline, line);
+			repeat = 0;
+		} else {
+			/* Repeated, don't print just count */
+			repeat++;
+		}
+	}
+
+	if (repeat)
+		fprintf(out, "Line repeated %ld time(s)\n", repeat);
+}
+
+
+/* A config with the usual ranges, listing to stdout */
+void
+cocotape_defaults(struct cocotape_config *cfg, uint32_t sample_rate)
+{
+	memset(cfg, 0, sizeof(struct cocotape_config));
+	cfg->sample_rate = sample_rate;
+	cfg->one_low = OL;
+	cfg->one_high = OH;
+	cfg->zero_low = ZL;
+	cfg->zero_high = ZH;
+	cfg->out = stdout;
+}
+
+/*
+ * Makes a decoder for a recording at cfg->sample_rate. One without an
+ * out prints nothing at all, not even the programs it decodes.
+ */
+struct cocotape *
+cocotape_new(const struct cocotape_config *cfg)
+{
+	struct cocotape	*dec;
+
+	if (cfg->sample_rate < MIN_RATE) {
+		PRINT_ERROR(cfg->out, "Sample rate %u below %u",
+			    cfg->sample_rate, MIN_RATE);
+		return(NULL);
+	}
+
+	/* The windows and framer share the first cache line */
+	if (posix_memalign((void **)&dec, 64, sizeof(struct cocotape))) {
+		PRINT_ERROR(cfg->out, "Failed to allocate decoder");
+		return(NULL);
+	}
+	memset(dec, 0, sizeof(struct cocotape));
+
+	decode_windows(dec, cfg->sample_rate, cfg->one_low, cfg->one_high,
+		       cfg->zero_low, cfg->zero_high);
+	dec->cal = cfg->autocal;
+	dec->catalog = cfg->catalog;
+	dec->first_line = cfg->first_line;
+	dec->last_line = cfg->last_line ? cfg->last_line : UINT16_MAX;
+	dec->stream = cfg->incremental && cfg->out && !cfg->on_prog &&
+		!cfg->catalog;
+	if (cfg->program) {
+		if (strlen(cfg->program) > PROGNAMELEN) {
+			PRINT_ERROR(cfg->out, "Program name %s longer than %d",
+				    cfg->program, PROGNAMELEN);
+			free(dec);
+			return(NULL);
+		}
+		memset(dec->program, ' ', PROGNAMELEN);
+		memcpy(dec->program, cfg->program, strlen(cfg->program));
+		dec->select = true;
+		dec->passing = true;
+	}
+	dec->resync = cfg->recover;
+	dec->keep = cfg->keep;
+
+	dec->out = cfg->out;
+	dec->on_block = cfg->on_block;
+	dec->on_prog = cfg->on_prog;
+	dec->arg = cfg->arg;
+
+	dec->quiet = !dec->out;
+	dec->debug = cfg->debug && !dec->quiet;
+	dec->verbose = cfg->verbose && !dec->quiet;
+	dec->run = (dec->debug || cfg->instr) ?
+		decode_periods_instr : decode_periods_prod;
+
+	scan_init(&dec->sc);
+	if (dec->debug) {
+		dec->sc.at = malloc((SCAN_CHUNK/2 + 1) * sizeof(uint32_t));
+		if (!dec->sc.at) {
+			PRINT_ERROR(dec->out, "Failed to allocate debug buffer");
+			free(dec);
+			return(NULL);
+		}
+	}
+
+	if (dec->verbose)
+		fprintf(dec->out, "Windows:  1 [%u.%02u, %u.%02u) "
+			"0 [%u.%02u, %u.%02u)\n",
+			PERIOD_FMT(dec->one_lo), PERIOD_FMT(dec->one_hi),
+			PERIOD_FMT(dec->zero_lo), PERIOD_FMT(dec->zero_hi));
+
+	return(dec);
+}
+
+/*
+ * Decodes n more samples, pass one turning them into periods and pass
+ * two decoding those periods right after, SCAN_CHUNK samples at a time.
+ * Unless keep was set only the last piece's periods are held on to.
+ * Returns non-zero if the decode could not go on.
+ */
+int
+cocotape_push_samples(struct cocotape *dec, const int16_t *buf, uint32_t n)
+{
+	uint32_t	len, first;
+	int		rc = 0;
+
+	for (uint32_t off = 0; !rc && !dec->done && (off < n); off += len) {
+		len = (n - off > SCAN_CHUNK) ? SCAN_CHUNK : n - off;
+
+		if (!dec->keep)
+			dec->pa.n = 0;
+		first = dec->pa.n;
+		dec->sc.nsat = 0;
+		dec->nsat = 0;
+		dec->sat_base = first;
+
+		/* Pass one */
+		if ((rc = scan_samples(dec, buf + off, len)))
+			break;
+
+		/* Pass two */
+		dec->dbg_data = buf + off;
+		dec->dbg_n = len;
+		dec->dbg_at = dec->sc.at;
+		rc = decode_periods(dec, dec->pa.p + first, dec->pa.n - first);
+	}
+
+	dec->dbg_data = NULL;
+	dec->dbg_at = NULL;
+
+	return(rc);
+}
+
+/*
+ * Decodes n periods from an earlier pass one, see cocotape_periods().
+ * They are not kept, the caller has them.
+ */
+int
+cocotape_push_periods(struct cocotape *dec, const uint16_t *p, uint32_t n)
+{
+	if (dec->done)
+		return(0);
+
+	/* Saturated periods are all there is to go on */
+	dec->nsat = dec->sc.nsat;
+	return(decode_periods(dec, p, n));
+}
+
+/*
+ * Takes n blocks some other decoder read as if this one had just read
+ * them, e.g. to put a recording decoded in pieces back together in
+ * tape order. Only for a decoder that is never pushed anything else.
+ * The blocks are numbered and put in programs afresh, their sample
+ * positions are kept as they are. Without recover a bad one ends the
+ * decode here as it would have where it was read, so the pieces are
+ * best read recovering.
+ */
+int
+cocotape_push_blocks(struct cocotape *dec, const struct block *b, uint32_t n)
+{
+	struct block	*nb;
+	int32_t		num, prog;
+
+	for (; n; n--, b++) {
+		if (new_block(dec))
+			return(-1);
+		nb = dec->fr.f_blk;
+		num = nb->b_num;
+		prog = nb->b_prog;
+		memcpy(nb, b, sizeof(struct block));
+		nb->b_num = num;
+		nb->b_prog = prog;
+
+		if (!b->b_bad)
+			dec->ngood++;
+		else if (bad_block(dec, nb))
+			return(1);
+
+		dec->nblk++;
+		dec->fr.f_blk = NULL;
+		if (dec->on_block)
+			dec->on_block(dec->arg, nb);
+		if (dec->stream && stream_block(dec, nb))
+			dec->nblk--;
+		if (b->b_type == BT_EOF)
+			prog_done(dec);
+	}
+
+	return(0);
+}
+
+/*
+ * End of the recording, hands over whatever program was still being
+ * read. The last bit is only counted at the crossing after it, which
+ * never comes, so the end stands in for it as one saturated period.
+ * Returns non-zero if any block failed its checksum or any program
+ * could not be listed.
+ */
+int
+cocotape_finish(struct cocotape *dec)
+{
+	uint16_t	end = PERIOD_MAX;
+
+	cocotape_push_periods(dec, &end, 1);
+	decode_finish(dec);
+	return((dec->nbad || dec->nlisterr || (dec->select && !dec->done)) ?
+	       1 : 0);
+}
+
+void
+cocotape_free(struct cocotape *dec)
+{
+	if (!dec)
+		return;
+	free(dec->blocks);
+	free(dec->img.pi_buf);
+	free(dec->pa.p);
+	free(dec->sc.at);
+	free(dec->sc.sat);
+	free(dec);
+}
+
+/* The periods pass one found, all of them if keep was set */
+const uint16_t *
+cocotape_periods(const struct cocotape *dec, uint32_t *n)
+{
+	*n = dec->pa.n;
+	return(dec->pa.p);
+}
+
+/*
+ * True if the decoder is between blocks, not part way through reading
+ * one, so the recording could be cut where it is.
+ */
+bool
+cocotape_idle(const struct cocotape *dec)
+{
+	if (dec->skip)
+		return(false);
+	return(!dec->fr.f_blk || (dec->fr.f_state == BS_NEED_SYNCBYTE));
+}
+
+/* True once the program asked for is done with, see SELECTING */
+bool
+cocotape_done(const struct cocotape *dec)
+{
+	return(dec->done);
+}
+
+/* Blocks passing and failing their checksum so far */
+void
+cocotape_stats(const struct cocotape *dec, int32_t *good, int32_t *bad)
+{
+	*good = dec->ngood;
+	*bad = dec->nbad;
+}
+
+/* Lists a program's blocks as BASIC, non-zero if they do not parse */
+int
+cocotape_list(FILE *out, const struct block *blocks, uint32_t n)
+{
+	struct prog_img	pi = { NULL, 0 };
+	int		rc;
+
+	rc = print_prog(out, &pi, blocks, n, false, 0, UINT16_MAX);
+	free(pi.pi_buf);
+	return(rc);
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2023, Philip Kufeldt
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * libcocotape, decodes TRS-80 Color Computer cassette recordings.
+ *
+ * A decoder is a struct cocotape, made with cocotape_new() from a
+ * struct cocotape_config. Samples are pushed into it with
+ * cocotape_push_samples() in pieces of any size, it keeps everything it
+ * needs between calls, and cocotape_finish() flushes out the end of the
+ * recording. Every block is handed to on_block as it is done and every
+ * program, Namefile block through End of File block, to on_prog.
+ * Without an on_prog, programs are listed to out, or with catalog set
+ * only named, their Data blocks skipped, or with incremental set listed
+ * a line at a time as their blocks come in. With program set only that
+ * one is, and the decoder is done after it, see cocotape_done().
+ * There are no globals, any number of decoders can run at once, each on
+ * one thread at a time.
+ * Pieces of one recording decoded apart can be put back together by
+ * pushing the blocks each read, in order, into another decoder with
+ * cocotape_push_blocks(), a recording is only cut where the decoder
+ * reading up to the cut is left idle, see cocotape_idle().
+ *
+ * See cocotape.c for the tape format and how it is decoded.
+ */
+#ifndef COCOTAPE_H
+#define COCOTAPE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+enum blocktype {
+	BT_NAME 	= 0x00,		/* Name block */
+	BT_DATA 	= 0x01,		/* Data block */
+	BT_EOF		= 0xFF,		/* End of file block */
+};
+
+/* Name blocks define what is in subsequent data blocks */
+enum filetype {
+	FT_BASIC	= 0x00,		/* CoCo encoded BASIC */
+	FT_DATA		= 0x01,		/* raw data?? */
+	FT_ML		= 0x02,		/* machine language code */
+};
+
+/* Defines if data is binary or ascii, so far only seen binary */
+enum asciiflag {
+	AF_BINARY	= 0x00,
+	AF_ASCII	= 0xFF,
+};
+
+/*
+ * Not sure what gapflag is for - service manual only defines
+ * continuous and gaps but have only seen 0x00.
+ */
+enum gapflag {
+	GF_UNKNOWN	= 0x00,
+	GF_CONT		= 0x01,
+	GF_GAPS		= 0xFF,
+};
+
+#define PROGNAMELEN 	8
+#define MLSTARTLEN 	2
+#define MLLOADLEN 	2
+#define NAMEBLOCKLEN    15
+#define BLOCKDATALEN	256	/* Up to 255 bytes, always a 0 after */
+
+/* A Namefile block's data as it is on tape, the name is space padded */
+struct namefile {
+	char		n_progname[PROGNAMELEN];
+	uint8_t		n_filetype;	/* enum filetype */
+	uint8_t		n_asciiflag;	/* enum asciiflag */
+	uint8_t		n_gapflag;	/* enum gapflag */
+	uint8_t		n_mlstart[MLSTARTLEN];
+	uint8_t		n_mlload[MLLOADLEN];
+};
+
+/* A block read off the tape */
+struct block {
+	enum blocktype	b_type;
+	uint8_t		b_length;
+	bool		b_bad;		/* Failed its checksum, */
+	uint8_t		b_cksum;	/* the one read off the tape */
+	uint8_t		b_sum;		/* not the sum of the block */
+	int32_t		b_num;		/* Position on the tape, from 1 */
+	int32_t		b_prog;		/* Program it is part of, from 1 */
+	uint64_t	b_start;	/* Samples it spans, [start, end), */
+	uint64_t	b_end;		/* see SAMPLE POSITIONS in cocotape.c */
+
+	union {
+		uint8_t		b_data[BLOCKDATALEN];
+		struct namefile	b_name;	/* b_type == BT_NAME */
+	};
+};
+
+/* Periods are fixed point sample counts with this many fraction bits */
+#define PERIOD_FRAC_BITS	4
+
+/* Anything longer (silence) is saturated to this */
+#define PERIOD_MAX		UINT16_MAX
+
+/* Below this a 2400Hz cycle is under 4 samples, too few to find */
+#define MIN_RATE		9600
+
+/* A block is done, blocks is only good until the callback returns */
+typedef void (*cocotape_block_fn)(void *arg, const struct block *b);
+
+/* A program is done, its n blocks in tape order, good until return */
+typedef void (*cocotape_prog_fn)(void *arg, const struct block *blocks,
+				 uint32_t n);
+
+struct cocotape_config {
+	uint32_t	sample_rate;
+
+	/* 1/0 ranges, inclusive data points at 44100Hz */
+	int		one_low, one_high;
+	int		zero_low, zero_high;
+
+	bool		autocal;	/* Calibrate at every leader */
+	bool		catalog;	/* Only list names, skip Data blocks */
+	const char	*program;	/* Only this program, NULL for all */
+	uint16_t	first_line;	/* Only list BASIC lines first_line */
+	uint16_t	last_line;	/* to last_line, 0 for to the end */
+	bool		incremental;	/* List lines as their blocks come in */
+	bool		recover;	/* Carry on past a bad checksum */
+	bool		keep;		/* Keep every period, see cocotape_periods() */
+	bool		debug;		/* Debug output to out */
+	bool		verbose;	/* Verbose output to out */
+	bool		instr;		/* Instrumented variant even without debug */
+
+	FILE		*out;		/* Listings and messages, NULL for none */
+	cocotape_block_fn on_block;
+	cocotape_prog_fn on_prog;
+	void		*arg;		/* Handed to the callbacks */
+};
+
+struct cocotape;
+
+void	cocotape_defaults(struct cocotape_config *cfg, uint32_t sample_rate);
+struct cocotape *cocotape_new(const struct cocotape_config *cfg);
+int	cocotape_push_samples(struct cocotape *ctx, const int16_t *buf,
+			      uint32_t n);
+int	cocotape_push_periods(struct cocotape *ctx, const uint16_t *p,
+			      uint32_t n);
+int	cocotape_push_blocks(struct cocotape *ctx, const struct block *b,
+			     uint32_t n);
+int	cocotape_finish(struct cocotape *ctx);
+void	cocotape_free(struct cocotape *ctx);
+const uint16_t *cocotape_periods(const struct cocotape *ctx, uint32_t *n);
+bool	cocotape_idle(const struct cocotape *ctx);
+bool	cocotape_done(const struct cocotape *ctx);
+void	cocotape_stats(const struct cocotape *ctx, int32_t *good, int32_t *bad);
+int	cocotape_list(FILE *out, const struct block *blocks, uint32_t n);
+bool	cocotape_has_avx2(void);
+
+#endif /* COCOTAPE_H */